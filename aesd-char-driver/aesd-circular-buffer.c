@@ -93,6 +93,160 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     }
 }
 
+/**
+* Adds @param count entries from @param add_entries to @param buffer in order, as if
+* aesd_circular_buffer_add_entry() had been called for each of them, but with a single pass
+* over the ring.
+* Entries overwritten because the buffer was full are copied, oldest first, into @param evicted_out
+* so the caller can release their memory.  At most @param count entries are ever evicted, so
+* @param evicted_out must have room for @param count entries; it may be NULL if the caller does
+* not own the evicted memory.
+* Any necessary locking must be handled by the caller.
+* @return the number of entries written to @param evicted_out
+*/
+size_t aesd_circular_buffer_add_entries(struct aesd_circular_buffer *buffer,
+                                        const struct aesd_buffer_entry *add_entries, size_t count,
+                                        struct aesd_buffer_entry *evicted_out)
+{
+    size_t evicted = 0;
+    size_t i;
+
+    /*
+     * Only the last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries of the batch can survive.
+     * Everything already in the ring is older than the whole batch, so drain it, then hand the
+     * leading part of the batch straight back without touching the ring.
+     */
+    if (count > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        size_t skip = count - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+        evicted = aesd_circular_buffer_drain(buffer, evicted_out);
+        if (evicted_out) {
+            memcpy(&evicted_out[evicted], add_entries, skip * sizeof(*add_entries));
+        }
+        evicted += skip;
+        add_entries += skip;
+        count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (buffer->full) {
+            if (evicted_out) {
+                evicted_out[evicted] = buffer->entry[buffer->in_offs];
+            }
+            evicted++;
+            buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        }
+        buffer->entry[buffer->in_offs] = add_entries[i];
+        buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if (buffer->in_offs == buffer->out_offs) {
+            buffer->full = true;
+        }
+    }
+    return evicted;
+}
+
+/**
+* Removes every entry from @param buffer, copying them in logical (oldest first) order into
+* @param drained_out, which must have room for AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
+* or may be NULL.  The buffer is left empty, as after aesd_circular_buffer_init().
+* Any necessary locking must be handled by the caller.
+* @return the number of entries removed
+*/
+size_t aesd_circular_buffer_drain(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *drained_out)
+{
+    size_t count = AESD_CIRCULAR_BUFFER_COUNT(buffer);
+    size_t i;
+
+    if (drained_out) {
+        for (i = 0; i < count; i++) {
+            drained_out[i] = buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        }
+    }
+    aesd_circular_buffer_init(buffer);
+    return count;
+}
+
+/**
+* Removes up to @param count of the oldest entries from @param buffer, copying them oldest first
+* into @param removed_out, which must have room for @param count entries or may be NULL.
+* Any necessary locking must be handled by the caller.
+* @return the number of entries removed, which is less than @param count only when the buffer
+* ran out of entries.
+*/
+size_t aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer,
+                                          size_t count, struct aesd_buffer_entry *removed_out)
+{
+    size_t held = AESD_CIRCULAR_BUFFER_COUNT(buffer);
+    size_t i;
+
+    if (count > held) {
+        count = held;
+    }
+    for (i = 0; i < count; i++) {
+        if (removed_out) {
+            removed_out[i] = buffer->entry[buffer->out_offs];
+        }
+        buffer->entry[buffer->out_offs].buffptr = NULL;
+        buffer->entry[buffer->out_offs].size = 0;
+        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->full = false;
+    }
+    return count;
+}
+
+/**
+* Copies up to @param len bytes starting at @param char_offset (zero referenced, as for
+* aesd_circular_buffer_find_entry_offset_for_fpos()) into @param dst, walking entries in logical
+* order and copying each contiguous run with a single memcpy.
+* @param dst must be directly addressable memory; callers copying to user space should copy
+* entry by entry with copy_to_user instead.
+* Any necessary locking must be handled by the caller.
+* @return the number of bytes copied, which is less than @param len only when the end of the
+* buffered data was reached.
+*/
+size_t aesd_circular_buffer_copy_range(struct aesd_circular_buffer *buffer,
+                                       size_t char_offset, size_t len, char *dst)
+{
+    size_t count = AESD_CIRCULAR_BUFFER_COUNT(buffer);
+    size_t copied = 0;
+    size_t i;
+
+    for (i = 0; i < count && copied < len; i++) {
+        const struct aesd_buffer_entry *entry =
+            &buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        size_t run;
+
+        if (char_offset >= entry->size) {
+            char_offset -= entry->size;
+            continue;
+        }
+        run = entry->size - char_offset;
+        if (run > len - copied) {
+            run = len - copied;
+        }
+        memcpy(dst + copied, entry->buffptr + char_offset, run);
+        copied += run;
+        char_offset = 0;
+    }
+    return copied;
+}
+
+/**
+* @return the total number of bytes held by all entries in @param buffer.
+* Any necessary locking must be handled by the caller.
+*/
+size_t aesd_circular_buffer_total_size(struct aesd_circular_buffer *buffer)
+{
+    size_t count = AESD_CIRCULAR_BUFFER_COUNT(buffer);
+    size_t total = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        total += buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
+    }
+    return total;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
 */
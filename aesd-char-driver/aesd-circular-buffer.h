@@ -56,8 +56,31 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern size_t aesd_circular_buffer_add_entries(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entries, size_t count,
+            struct aesd_buffer_entry *evicted_out);
+
+extern size_t aesd_circular_buffer_drain(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *drained_out);
+
+extern size_t aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer,
+            size_t count, struct aesd_buffer_entry *removed_out);
+
+extern size_t aesd_circular_buffer_copy_range(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t len, char *dst);
+
+extern size_t aesd_circular_buffer_total_size(struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+/**
+ * @return the number of valid entries currently held in @param buffer
+ */
+#define AESD_CIRCULAR_BUFFER_COUNT(buffer) \
+    ((buffer)->full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : \
+        (((buffer)->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - (buffer)->out_offs) \
+            % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED))
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
@@ -23,6 +23,88 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#else
+#include <sys/ioctl.h>
+#endif
+#include <linux/types.h>
+
+/*
+ * Snapshot format shared by the driver and aesdsocket:
+ *   struct aesd_snapshot_header
+ *   __u32 entry_size[entry_count]     sizes of each command, oldest first
+ *   payload_bytes bytes of command data, concatenated in the same order
+ * All fields are in host byte order; snapshots are not meant to move between machines.
+ */
+#define AESD_SNAPSHOT_MAGIC   0x50534541  /* "AESP" */
+#define AESD_SNAPSHOT_VERSION 1
+/* Loads reject larger entry counts; only the newest entries of a snapshot are kept anyway */
+#define AESD_SNAPSHOT_MAX_ENTRIES 65536
+
+struct aesd_snapshot_header {
+    __u32 magic;
+    __u32 version;
+    __u32 entry_count;
+    __u32 reserved;
+    __u64 payload_bytes;
+};
+
+/**
+ * Argument for the snapshot ioctls.
+ */
+struct aesd_snapshot_buf {
+    /* User space address of the snapshot buffer */
+    __u64 data;
+    /* Capacity of data on input; snapshot length on output (or required capacity on ENOSPC) */
+    __u64 size;
+};
+
+#define AESD_IOC_MAGIC 0x16
+/*
+ * The course assignments use AESD_IOC_MAGIC numbers below 10 (AESDCHAR_IOCSEEKTO is 1), so the
+ * ioctls added here start at 10 and can't collide with them.
+ */
+
+/* Serialize the current history into data. Fails with ENOSPC and sets size if data is too small */
+#define AESDCHAR_IOCSNAPSHOT_SAVE _IOWR(AESD_IOC_MAGIC, 10, struct aesd_snapshot_buf)
+/* Replace the current history (and any partial command) with the snapshot in data */
+#define AESDCHAR_IOCSNAPSHOT_LOAD _IOW(AESD_IOC_MAGIC, 11, struct aesd_snapshot_buf)
+
+#define AESD_SEARCH_MAX_NEEDLE 256
+
+/**
+ * One occurrence of the needle in the history.
+ */
+struct aesd_search_match {
+    /* Command index, 0 being the oldest retained command */
+    __u32 entry;
+    /* Offset of the occurrence within that command */
+    __u32 offset;
+    /* Offset of the occurrence in the device, as used by read() and lseek() */
+    __u64 fpos;
+};
+
+/**
+ * Argument for AESDCHAR_IOCSEARCH.
+ */
+struct aesd_search {
+    /* User space address and length (1..AESD_SEARCH_MAX_NEEDLE) of the bytes to find */
+    __u64 needle;
+    __u32 needle_len;
+    /* Capacity of matches */
+    __u32 max_matches;
+    /* User space address of struct aesd_search_match[max_matches] */
+    __u64 matches;
+    /* Out: number of occurrences found; only the first max_matches are stored */
+    __u32 match_count;
+    __u32 reserved;
+};
+
+/* Find every occurrence of needle in the retained commands, oldest first */
+#define AESDCHAR_IOCSEARCH _IOWR(AESD_IOC_MAGIC, 12, struct aesd_search)
+
+#ifdef __KERNEL__
 struct incomplete_command {
     char *buffer;
     size_t size;
@@ -37,7 +119,10 @@ struct aesd_dev
      struct mutex device_lock;
      struct cdev cdev;     /* Char device structure      */
      struct incomplete_command incomplete_cmd;
+     size_t buffered_bytes;       /* Sum of entry sizes held in buffer */
+     struct shrinker *shrinker;   /* Lets the kernel reclaim history under memory pressure */
 };
+#endif /* __KERNEL__ */
 
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -0,0 +1,85 @@
+/**
+ * @file aesdchar_trace.h
+ * @brief Tracepoints for the aesdchar driver
+ *
+ * Enable with e.g. "echo 1 > /sys/kernel/tracing/events/aesdchar/enable".  Disabled
+ * tracepoints cost a static branch; the lock wait timestamps are only taken while
+ * aesd_lock_wait is enabled.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(_AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(aesd_lock_wait,
+    TP_PROTO(bool write, u64 wait_ns),
+    TP_ARGS(write, wait_ns),
+    TP_STRUCT__entry(
+        __field(bool, write)
+        __field(u64, wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->write = write;
+        __entry->wait_ns = wait_ns;
+    ),
+    TP_printk("op=%s wait_ns=%llu", __entry->write ? "write" : "read", __entry->wait_ns)
+);
+
+TRACE_EVENT(aesd_read,
+    TP_PROTO(size_t count, loff_t pos, ssize_t ret),
+    TP_ARGS(count, pos, ret),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, pos)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pos = pos;
+        __entry->ret = ret;
+    ),
+    TP_printk("count=%zu pos=%lld ret=%zd", __entry->count, __entry->pos, __entry->ret)
+);
+
+TRACE_EVENT(aesd_write,
+    TP_PROTO(size_t count, size_t buffered_bytes, size_t pending_bytes),
+    TP_ARGS(count, buffered_bytes, pending_bytes),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(size_t, buffered_bytes)
+        __field(size_t, pending_bytes)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->buffered_bytes = buffered_bytes;
+        __entry->pending_bytes = pending_bytes;
+    ),
+    TP_printk("count=%zu buffered=%zu pending=%zu", __entry->count,
+              __entry->buffered_bytes, __entry->pending_bytes)
+);
+
+TRACE_EVENT(aesd_evict,
+    TP_PROTO(size_t entries, size_t bytes),
+    TP_ARGS(entries, bytes),
+    TP_STRUCT__entry(
+        __field(size_t, entries)
+        __field(size_t, bytes)
+    ),
+    TP_fast_assign(
+        __entry->entries = entries;
+        __entry->bytes = bytes;
+    ),
+    TP_printk("entries=%zu bytes=%zu", __entry->entries, __entry->bytes)
+);
+
+#endif /* _AESDCHAR_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
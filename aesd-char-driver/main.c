@@ -17,9 +17,22 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+#include <linux/shrinker.h>
+#include <linux/version.h>
+#include <linux/ktime.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
 
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
+
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
 int aesd_major =   0; // use dynamic major
@@ -30,6 +43,329 @@ MODULE_LICENSE("Dual BSD/GPL");
 
 struct aesd_dev aesd_device;
 
+/*
+ * Byte budget for retained history plus the pending partial command. The oldest entries are
+ * evicted once the budget is exceeded, although the most recent command is always kept.
+ */
+static unsigned long aesd_max_bytes = 1024 * 1024;
+module_param(aesd_max_bytes, ulong, 0644);
+MODULE_PARM_DESC(aesd_max_bytes, "Maximum bytes of command history retained (default 1MiB)");
+
+/* Largest command, partial data included, accepted before writes fail with EFBIG */
+static unsigned long aesd_max_command_bytes = 64 * 1024;
+module_param(aesd_max_command_bytes, ulong, 0644);
+MODULE_PARM_DESC(aesd_max_command_bytes, "Maximum bytes of a single command, partial data included (default 64KiB)");
+
+/*
+ * With dedup on, a completed command identical to one still retained shares its payload
+ * instead of getting a copy. Reads are unaffected: every ring entry still sees its full
+ * command. Can be switched at runtime; payloads already shared stay shared.
+ */
+static bool aesd_dedup = false;
+module_param(aesd_dedup, bool, 0644);
+MODULE_PARM_DESC(aesd_dedup, "Share the payload of identical retained commands (default off)");
+
+static unsigned long aesd_dedup_hits;
+module_param(aesd_dedup_hits, ulong, 0444);
+MODULE_PARM_DESC(aesd_dedup_hits, "Commands stored by sharing an existing payload");
+
+/*
+ * A payload's trigram filter is built on the first search that reaches it, with this many
+ * bits per payload byte rounded up to a power of two, between 1 << AESD_FILTER_MIN_SHIFT and
+ * 1 << AESD_FILTER_MAX_SHIFT bits. Filters count against aesd_max_bytes and are the first
+ * thing dropped when the budget is exceeded; a search rebuilds them.
+ */
+#define AESD_FILTER_BITS_PER_BYTE 4
+#define AESD_FILTER_MIN_SHIFT 8
+#define AESD_FILTER_MAX_SHIFT 16
+
+/*
+ * Every ring entry's buffptr points at the data of one of these. Payloads of deduplicated
+ * commands are also hashed in aesd_payloads so later identical commands can find them.
+ * refs and the hash table are protected by device_lock.
+ */
+struct aesd_payload {
+    struct hlist_node node;
+    u32 hash;
+    unsigned int refs;    /* Ring entries pointing at data */
+    unsigned int filter_shift;  /* log2 of the filter size in bits */
+    u64 *filter;          /* Bloom filter of the trigrams in data, NULL until searched */
+    size_t size;
+    char data[];
+};
+
+#define AESD_PAYLOAD_HASH_BITS 6
+static DEFINE_HASHTABLE(aesd_payloads, AESD_PAYLOAD_HASH_BITS);
+
+/* Memory held by payload filters, protected by device_lock */
+static size_t aesd_filter_bytes;
+
+static struct aesd_payload *aesd_payload_of(const char *buffptr)
+{
+    return (struct aesd_payload *)(buffptr - offsetof(struct aesd_payload, data));
+}
+
+/**
+ * Allocate an unshared payload of @param size bytes with a single reference.
+ * @return the payload data for an entry's buffptr, or NULL
+ */
+static char *aesd_payload_alloc(size_t size)
+{
+    struct aesd_payload *payload;
+
+    payload = kmalloc(struct_size(payload, data, size), GFP_KERNEL);
+    if (!payload) {
+        return NULL;
+    }
+    INIT_HLIST_NODE(&payload->node);
+    payload->refs = 1;
+    payload->filter_shift = 0;
+    payload->filter = NULL;
+    payload->size = size;
+    return payload->data;
+}
+
+static void aesd_filter_free(struct aesd_payload *payload)
+{
+    if (payload->filter) {
+        kvfree(payload->filter);
+        payload->filter = NULL;
+        aesd_filter_bytes -= (1UL << payload->filter_shift) / 8;
+    }
+}
+
+/**
+ * Drop one reference to the payload behind @param buffptr, freeing it with the last one.
+ * Caller must hold device_lock unless the payload was never shared.
+ */
+static void aesd_payload_put(const char *buffptr)
+{
+    struct aesd_payload *payload = aesd_payload_of(buffptr);
+
+    if (--payload->refs == 0) {
+        if (hash_hashed(&payload->node)) {
+            hash_del(&payload->node);
+        }
+        aesd_filter_free(payload);
+        kfree(payload);
+    }
+}
+
+/**
+ * @return the hash of the trigram starting at @param p; its two halves pick the filter bits
+ */
+static u64 aesd_trigram_hash(const char *p)
+{
+    return hash_64((u8)p[0] | (u8)p[1] << 8 | (u8)p[2] << 16, 64);
+}
+
+/**
+ * Build the trigram filter of @param payload if the byte budget has room for it.
+ * Caller must hold device_lock.
+ * @return true if @param payload has a filter
+ */
+static bool aesd_filter_build(struct aesd_dev *dev, struct aesd_payload *payload)
+{
+    unsigned int shift = clamp_t(unsigned int,
+                                 order_base_2(payload->size * AESD_FILTER_BITS_PER_BYTE),
+                                 AESD_FILTER_MIN_SHIFT, AESD_FILTER_MAX_SHIFT);
+    size_t bytes = (1UL << shift) / 8;
+    u64 mask = (1ULL << shift) - 1;
+    size_t i;
+
+    if (payload->filter) {
+        return true;
+    }
+    if (dev->buffered_bytes + dev->incomplete_cmd.size + aesd_filter_bytes + bytes > aesd_max_bytes) {
+        return false;
+    }
+    payload->filter = kvzalloc(bytes, GFP_KERNEL);
+    if (!payload->filter) {
+        return false;
+    }
+    payload->filter_shift = shift;
+    aesd_filter_bytes += bytes;
+    for (i = 0; i + 3 <= payload->size; i++) {
+        u64 hash = aesd_trigram_hash(payload->data + i);
+        u64 a = hash & mask, b = ror64(hash, 32) & mask;
+
+        payload->filter[a / 64] |= 1ULL << (a % 64);
+        payload->filter[b / 64] |= 1ULL << (b % 64);
+    }
+    return true;
+}
+
+/**
+ * Free the filters of every retained payload. Caller must hold device_lock.
+ */
+static void aesd_filter_drop_all(struct aesd_dev *dev)
+{
+    struct aesd_circular_buffer *buffer = dev->buffer;
+    size_t count = AESD_CIRCULAR_BUFFER_COUNT(buffer);
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        aesd_filter_free(aesd_payload_of(
+            buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].buffptr));
+    }
+}
+
+/**
+ * @return false if the trigram with @param hash is certainly not in @param payload
+ */
+static bool aesd_filter_test(const struct aesd_payload *payload, u64 hash)
+{
+    u64 mask = (1ULL << payload->filter_shift) - 1;
+    u64 a = hash & mask, b = ror64(hash, 32) & mask;
+
+    return (payload->filter[a / 64] & (1ULL << (a % 64))) &&
+           (payload->filter[b / 64] & (1ULL << (b % 64)));
+}
+
+/**
+ * Finish the freshly filled payload @param buffptr: with dedup on, swap it for an identical
+ * retained payload if there is one, otherwise make it findable.
+ * Caller must hold device_lock.
+ * @return the payload data the new entry should point at
+ */
+static const char *aesd_payload_intern(char *buffptr)
+{
+    struct aesd_payload *payload = aesd_payload_of(buffptr);
+    struct aesd_payload *existing;
+
+    if (!aesd_dedup) {
+        return buffptr;
+    }
+    payload->hash = jhash(payload->data, payload->size, 0);
+    hash_for_each_possible(aesd_payloads, existing, node, payload->hash) {
+        if (existing->hash == payload->hash && existing->size == payload->size &&
+            memcmp(existing->data, payload->data, payload->size) == 0) {
+            existing->refs++;
+            aesd_dedup_hits++;
+            kfree(payload);
+            return existing->data;
+        }
+    }
+    hash_add(aesd_payloads, &payload->node, payload->hash);
+    return buffptr;
+}
+
+/**
+ * Remove and free up to @param count of the oldest entries in the device buffer.
+ * Caller must hold device_lock.
+ * @return the number of entries freed
+ */
+static size_t aesd_evict_oldest(struct aesd_dev *dev, size_t count)
+{
+    struct aesd_buffer_entry removed[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t n, i, bytes = 0;
+
+    count = MIN(count, (size_t)AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    n = aesd_circular_buffer_remove_oldest(dev->buffer, count, removed);
+    for (i = 0; i < n; i++) {
+        bytes += removed[i].size;
+        aesd_payload_put(removed[i].buffptr);
+    }
+    dev->buffered_bytes -= bytes;
+    trace_aesd_evict(n, bytes);
+    return n;
+}
+
+/**
+ * Take device_lock, reporting how long it took through the aesd_lock_wait tracepoint.
+ * The clock is only read while that tracepoint is enabled.
+ */
+static void aesd_lock(struct aesd_dev *dev, bool write)
+{
+    u64 start;
+
+    if (!trace_aesd_lock_wait_enabled()) {
+        mutex_lock(&dev->device_lock);
+        return;
+    }
+    start = ktime_get_ns();
+    mutex_lock(&dev->device_lock);
+    trace_aesd_lock_wait(write, ktime_get_ns() - start);
+}
+
+/**
+ * Drop the search filters, then evict oldest entries until history plus the partial command
+ * fit in aesd_max_bytes, always keeping the newest entry. Caller must hold device_lock.
+ */
+static void aesd_enforce_byte_budget(struct aesd_dev *dev)
+{
+    if (aesd_filter_bytes &&
+        dev->buffered_bytes + dev->incomplete_cmd.size + aesd_filter_bytes > aesd_max_bytes) {
+        aesd_filter_drop_all(dev);
+    }
+    while (dev->buffered_bytes + dev->incomplete_cmd.size > aesd_max_bytes &&
+           AESD_CIRCULAR_BUFFER_COUNT(dev->buffer) > 1) {
+        aesd_evict_oldest(dev, 1);
+    }
+}
+
+static unsigned long aesd_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+    unsigned long count = AESD_CIRCULAR_BUFFER_COUNT(aesd_device.buffer);
+
+    return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long aesd_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+    unsigned long freed;
+
+    // Never block reclaim behind a reader or writer holding the lock
+    if (!mutex_trylock(&aesd_device.device_lock)) {
+        return SHRINK_STOP;
+    }
+    aesd_filter_drop_all(&aesd_device);
+    freed = aesd_evict_oldest(&aesd_device, sc->nr_to_scan);
+    mutex_unlock(&aesd_device.device_lock);
+    return freed ? freed : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static int aesd_register_shrinker(struct aesd_dev *dev)
+{
+    dev->shrinker = shrinker_alloc(0, "aesdchar");
+    if (!dev->shrinker) {
+        return -ENOMEM;
+    }
+    dev->shrinker->count_objects = aesd_shrink_count;
+    dev->shrinker->scan_objects = aesd_shrink_scan;
+    dev->shrinker->seeks = DEFAULT_SEEKS;
+    shrinker_register(dev->shrinker);
+    return 0;
+}
+
+static void aesd_unregister_shrinker(struct aesd_dev *dev)
+{
+    shrinker_free(dev->shrinker);
+}
+#else
+static struct shrinker aesd_shrinker = {
+    .count_objects = aesd_shrink_count,
+    .scan_objects = aesd_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+
+static int aesd_register_shrinker(struct aesd_dev *dev)
+{
+    dev->shrinker = &aesd_shrinker;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return register_shrinker(dev->shrinker, "aesdchar");
+#else
+    return register_shrinker(dev->shrinker);
+#endif
+}
+
+static void aesd_unregister_shrinker(struct aesd_dev *dev)
+{
+    unregister_shrinker(dev->shrinker);
+}
+#endif
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
     PDEBUG("open");
@@ -49,7 +385,7 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     ssize_t total_bytes_read = 0;
     PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
     
-    mutex_lock(&aesd_device.device_lock);
+    aesd_lock(&aesd_device, false);
     
     while (count > 0 && total_bytes_read < count) {
         struct aesd_buffer_entry *entry;
@@ -79,6 +415,7 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     }
     
     mutex_unlock(&aesd_device.device_lock);
+    trace_aesd_read(count, *f_pos, total_bytes_read > 0 ? total_bytes_read : retval);
     return total_bytes_read > 0 ? total_bytes_read : retval;
 }
 
@@ -88,7 +425,19 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     ssize_t retval = -ENOMEM;
     PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
     
-    mutex_lock(&aesd_device.device_lock);
+    aesd_lock(&aesd_device, true);
+
+    /*
+     * Refuse to let a command, including any unterminated data already buffered, grow without
+     * bound. The pending data is kept so a client can still terminate it with a smaller write.
+     */
+    if (count > aesd_max_command_bytes ||
+        aesd_device.incomplete_cmd.size + count > aesd_max_command_bytes) {
+        PDEBUG("command would exceed %lu bytes", aesd_max_command_bytes);
+        mutex_unlock(&aesd_device.device_lock);
+        return -EFBIG;
+    }
+
     char *kernel_buf = kmalloc(count, GFP_KERNEL);
 
     if (aesd_device.incomplete_cmd.buffer) {
@@ -116,18 +465,20 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
         PDEBUG("a new line detected");
         // Complete command - add to circular buffer (exclude the newline)
         struct aesd_buffer_entry entry;
+        struct aesd_buffer_entry evicted;
+        char *payload;
         
         if (aesd_device.incomplete_cmd.buffer) {
             PDEBUG("the previous command is not empty and buffer = %s", aesd_device.incomplete_cmd.buffer);
             // Combine accumulated data with current write (keep the newline)
-            entry.buffptr = kmalloc(aesd_device.incomplete_cmd.size + count, GFP_KERNEL);
-            if (!entry.buffptr) {
+            payload = aesd_payload_alloc(aesd_device.incomplete_cmd.size + count);
+            if (!payload) {
                 kfree(kernel_buf);
                 mutex_unlock(&aesd_device.device_lock);
                 return -ENOMEM;
             }
-            memcpy((void*)entry.buffptr, aesd_device.incomplete_cmd.buffer, aesd_device.incomplete_cmd.size);
-            memcpy((void*)entry.buffptr + aesd_device.incomplete_cmd.size, kernel_buf, count);  // Include newline
+            memcpy(payload, aesd_device.incomplete_cmd.buffer, aesd_device.incomplete_cmd.size);
+            memcpy(payload + aesd_device.incomplete_cmd.size, kernel_buf, count);  // Include newline
             entry.size = aesd_device.incomplete_cmd.size + count;  // Include newline in size
             
             kfree(aesd_device.incomplete_cmd.buffer);
@@ -137,18 +488,26 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
         } else {
             PDEBUG("new line but previous command is empty");
             // Just current write (keep the newline)
-            entry.buffptr = kmalloc(count, GFP_KERNEL);
-            if (!entry.buffptr) {
+            payload = aesd_payload_alloc(count);
+            if (!payload) {
                 kfree(kernel_buf);
                 mutex_unlock(&aesd_device.device_lock);
                 return -ENOMEM;
             }
-            memcpy((void*)entry.buffptr, kernel_buf, count);  // Include newline
+            memcpy(payload, kernel_buf, count);  // Include newline
             entry.size = count;  // Include newline in size
             kfree(kernel_buf);
         }
         
-        aesd_circular_buffer_add_entry(aesd_device.buffer, &entry);
+        entry.buffptr = aesd_payload_intern(payload);
+
+        // Release whatever the ring had to overwrite to make room for the new command
+        if (aesd_circular_buffer_add_entries(aesd_device.buffer, &entry, 1, &evicted)) {
+            aesd_device.buffered_bytes -= evicted.size;
+            aesd_payload_put(evicted.buffptr);
+        }
+        aesd_device.buffered_bytes += entry.size;
+        aesd_enforce_byte_budget(&aesd_device);
         retval = count;  // Return bytes from THIS write operation
     } else {
         PDEBUG("THIS IS A INCOMPLETE COMMAND NO NEWLINE DETECTED");
@@ -177,17 +536,335 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
             aesd_device.incomplete_cmd.size = count;
         }
         kfree(kernel_buf);
+        aesd_enforce_byte_budget(&aesd_device);
         retval = count;  // Return bytes from THIS write operation
     }
-        
+
+    trace_aesd_write(count, aesd_device.buffered_bytes, aesd_device.incomplete_cmd.size);
     mutex_unlock(&aesd_device.device_lock);
     return retval;
 }
 
+/**
+ * Serialize the device history into the user buffer described by @param argp using the
+ * snapshot format from aesdchar.h.
+ */
+static long aesd_snapshot_save(struct aesd_dev *dev, struct aesd_snapshot_buf __user *argp)
+{
+    struct aesd_snapshot_buf req;
+    struct aesd_snapshot_header hdr;
+    struct aesd_circular_buffer *buffer = dev->buffer;
+    char __user *dst;
+    size_t count, needed, i;
+    long retval = 0;
+
+    if (copy_from_user(&req, argp, sizeof(req))) {
+        return -EFAULT;
+    }
+
+    aesd_lock(dev, false);
+    count = AESD_CIRCULAR_BUFFER_COUNT(buffer);
+    needed = sizeof(hdr) + count * sizeof(__u32) + dev->buffered_bytes;
+    if (req.size < needed) {
+        retval = -ENOSPC;
+        goto out;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = AESD_SNAPSHOT_MAGIC;
+    hdr.version = AESD_SNAPSHOT_VERSION;
+    hdr.entry_count = count;
+    hdr.payload_bytes = dev->buffered_bytes;
+
+    dst = u64_to_user_ptr(req.data);
+    if (copy_to_user(dst, &hdr, sizeof(hdr))) {
+        retval = -EFAULT;
+        goto out;
+    }
+    dst += sizeof(hdr);
+    for (i = 0; i < count; i++) {
+        __u32 size = buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
+
+        if (copy_to_user(dst, &size, sizeof(size))) {
+            retval = -EFAULT;
+            goto out;
+        }
+        dst += sizeof(size);
+    }
+    for (i = 0; i < count; i++) {
+        struct aesd_buffer_entry *entry =
+            &buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+
+        if (copy_to_user(dst, entry->buffptr, entry->size)) {
+            retval = -EFAULT;
+            goto out;
+        }
+        dst += entry->size;
+    }
+
+out:
+    mutex_unlock(&dev->device_lock);
+    req.size = needed;
+    if (copy_to_user(argp, &req, sizeof(req))) {
+        return -EFAULT;
+    }
+    return retval;
+}
+
+/**
+ * Replace the device history with the snapshot in the user buffer described by @param argp.
+ * Only the newest AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries of the snapshot are kept.
+ */
+static long aesd_snapshot_load(struct aesd_dev *dev, struct aesd_snapshot_buf __user *argp)
+{
+    struct aesd_snapshot_buf req;
+    struct aesd_snapshot_header hdr;
+    struct aesd_buffer_entry entries[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry old[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    const char __user *src;
+    __u32 *sizes = NULL;
+    size_t skip, loaded = 0, loaded_bytes = 0, i, n;
+    __u64 total = 0;
+    long retval = 0;
+
+    if (copy_from_user(&req, argp, sizeof(req))) {
+        return -EFAULT;
+    }
+    src = u64_to_user_ptr(req.data);
+    if (req.size < sizeof(hdr) || copy_from_user(&hdr, src, sizeof(hdr))) {
+        return req.size < sizeof(hdr) ? -EINVAL : -EFAULT;
+    }
+    if (hdr.magic != AESD_SNAPSHOT_MAGIC || hdr.version != AESD_SNAPSHOT_VERSION ||
+        hdr.entry_count > AESD_SNAPSHOT_MAX_ENTRIES) {
+        return -EINVAL;
+    }
+    if (req.size - sizeof(hdr) < (__u64)hdr.entry_count * sizeof(__u32) ||
+        req.size - sizeof(hdr) - (__u64)hdr.entry_count * sizeof(__u32) != hdr.payload_bytes) {
+        return -EINVAL;
+    }
+    src += sizeof(hdr);
+
+    if (hdr.entry_count) {
+        sizes = kvmalloc_array(hdr.entry_count, sizeof(__u32), GFP_KERNEL);
+        if (!sizes) {
+            return -ENOMEM;
+        }
+        if (copy_from_user(sizes, src, hdr.entry_count * sizeof(__u32))) {
+            retval = -EFAULT;
+            goto out_free_sizes;
+        }
+    }
+    src += hdr.entry_count * sizeof(__u32);
+    for (i = 0; i < hdr.entry_count; i++) {
+        if (sizes[i] == 0) {
+            retval = -EINVAL;
+            goto out_free_sizes;
+        }
+        total += sizes[i];
+    }
+    if (total != hdr.payload_bytes) {
+        retval = -EINVAL;
+        goto out_free_sizes;
+    }
+
+    skip = hdr.entry_count > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ?
+        hdr.entry_count - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : 0;
+    for (i = 0; i < skip; i++) {
+        src += sizes[i];
+    }
+    for (i = skip; i < hdr.entry_count; i++) {
+        char *buffptr = aesd_payload_alloc(sizes[i]);
+
+        if (!buffptr) {
+            retval = -ENOMEM;
+            goto out_free_entries;
+        }
+        if (copy_from_user(buffptr, src, sizes[i])) {
+            aesd_payload_put(buffptr);
+            retval = -EFAULT;
+            goto out_free_entries;
+        }
+        entries[loaded].buffptr = buffptr;
+        entries[loaded].size = sizes[i];
+        loaded_bytes += sizes[i];
+        loaded++;
+        src += sizes[i];
+    }
+
+    aesd_lock(dev, true);
+    n = aesd_circular_buffer_drain(dev->buffer, old);
+    // Old payloads may be shared and hashed, so release them under the lock
+    for (i = 0; i < n; i++) {
+        aesd_payload_put(old[i].buffptr);
+    }
+    for (i = 0; i < loaded; i++) {
+        entries[i].buffptr = aesd_payload_intern((char *)entries[i].buffptr);
+    }
+    aesd_circular_buffer_add_entries(dev->buffer, entries, loaded, NULL);
+    dev->buffered_bytes = loaded_bytes;
+    kfree(dev->incomplete_cmd.buffer);
+    dev->incomplete_cmd.buffer = NULL;
+    dev->incomplete_cmd.size = 0;
+    aesd_enforce_byte_budget(dev);
+    mutex_unlock(&dev->device_lock);
+
+    kvfree(sizes);
+    return 0;
+
+out_free_entries:
+    for (i = 0; i < loaded; i++) {
+        aesd_payload_put(entries[i].buffptr);
+    }
+out_free_sizes:
+    kvfree(sizes);
+    return retval;
+}
+
+struct aesd_search_ctx {
+    u8 needle[AESD_SEARCH_MAX_NEEDLE];
+    size_t len;
+    u16 skip[256];        /* Horspool shift for the byte under the needle's last position */
+    u64 trigrams[AESD_SEARCH_MAX_NEEDLE];  /* Hashes of the needle's trigrams */
+    size_t ntrigrams;
+};
+
+static void aesd_search_prepare(struct aesd_search_ctx *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < 256; i++) {
+        ctx->skip[i] = ctx->len;
+    }
+    for (i = 0; i + 1 < ctx->len; i++) {
+        ctx->skip[ctx->needle[i]] = ctx->len - 1 - i;
+    }
+    ctx->ntrigrams = 0;
+    for (i = 0; i + 3 <= ctx->len; i++) {
+        ctx->trigrams[ctx->ntrigrams++] = aesd_trigram_hash((const char *)ctx->needle + i);
+    }
+}
+
+/**
+ * @return false if the trigram filter of @param payload rules out a match, building the
+ * filter first if it has none. Caller must hold device_lock.
+ */
+static bool aesd_search_candidate(struct aesd_dev *dev, const struct aesd_search_ctx *ctx,
+                                  struct aesd_payload *payload)
+{
+    size_t i;
+
+    if (ctx->ntrigrams == 0 || !aesd_filter_build(dev, payload)) {
+        return true;
+    }
+    for (i = 0; i < ctx->ntrigrams; i++) {
+        if (!aesd_filter_test(payload, ctx->trigrams[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Report every occurrence of the needle in the retained commands. Commands whose trigram
+ * filter lacks a needle trigram are skipped without reading their data; filters grow with
+ * their command up to AESD_FILTER_MAX_SHIFT so they stay selective, and once built, for
+ * needles of three or more bytes the cost follows the commands that can match rather than the
+ * bytes buffered. Commands without room in the byte budget for a filter are always scanned.
+ * Candidates are scanned with Boyer-Moore-Horspool.
+ */
+static long aesd_search(struct aesd_dev *dev, struct aesd_search __user *argp)
+{
+    struct aesd_search req;
+    struct aesd_search_ctx *ctx;
+    struct aesd_search_match __user *out;
+    struct aesd_circular_buffer *buffer = dev->buffer;
+    size_t count, i;
+    u64 fpos = 0;
+    u32 found = 0;
+    long retval = 0;
+
+    if (copy_from_user(&req, argp, sizeof(req))) {
+        return -EFAULT;
+    }
+    if (req.needle_len == 0 || req.needle_len > AESD_SEARCH_MAX_NEEDLE) {
+        return -EINVAL;
+    }
+    ctx = kmalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx) {
+        return -ENOMEM;
+    }
+    ctx->len = req.needle_len;
+    if (copy_from_user(ctx->needle, u64_to_user_ptr(req.needle), ctx->len)) {
+        kfree(ctx);
+        return -EFAULT;
+    }
+    aesd_search_prepare(ctx);
+    out = u64_to_user_ptr(req.matches);
+
+    aesd_lock(dev, false);
+    count = AESD_CIRCULAR_BUFFER_COUNT(buffer);
+    for (i = 0; i < count; i++) {
+        struct aesd_buffer_entry *entry =
+            &buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        const u8 *data = (const u8 *)entry->buffptr;
+        size_t pos = 0;
+
+        if (entry->size >= ctx->len && aesd_search_candidate(dev, ctx, aesd_payload_of(entry->buffptr))) {
+            while (pos + ctx->len <= entry->size) {
+                u8 last = data[pos + ctx->len - 1];
+
+                if (last == ctx->needle[ctx->len - 1] &&
+                    memcmp(data + pos, ctx->needle, ctx->len - 1) == 0) {
+                    struct aesd_search_match match = {
+                        .entry = i,
+                        .offset = pos,
+                        .fpos = fpos + pos,
+                    };
+
+                    if (found < req.max_matches && copy_to_user(&out[found], &match, sizeof(match))) {
+                        retval = -EFAULT;
+                        goto out;
+                    }
+                    found++;
+                }
+                pos += ctx->skip[last];
+            }
+        }
+        fpos += entry->size;
+    }
+
+out:
+    mutex_unlock(&dev->device_lock);
+    kfree(ctx);
+    if (retval) {
+        return retval;
+    }
+    req.match_count = found;
+    if (copy_to_user(argp, &req, sizeof(req))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+    case AESDCHAR_IOCSNAPSHOT_SAVE:
+        return aesd_snapshot_save(&aesd_device, (struct aesd_snapshot_buf __user *)arg);
+    case AESDCHAR_IOCSNAPSHOT_LOAD:
+        return aesd_snapshot_load(&aesd_device, (struct aesd_snapshot_buf __user *)arg);
+    case AESDCHAR_IOCSEARCH:
+        return aesd_search(&aesd_device, (struct aesd_search __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .read =     aesd_read,
     .write =    aesd_write,
+    .unlocked_ioctl = aesd_ioctl,
     .open =     aesd_open,
     .release =  aesd_release,
 };
@@ -231,9 +908,17 @@ int aesd_init_module(void)
     aesd_circular_buffer_init(aesd_device.buffer);
     mutex_init(&aesd_device.device_lock);
 
+    result = aesd_register_shrinker(&aesd_device);
+    if (result) {
+        kfree(aesd_device.buffer);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
+
     result = aesd_setup_cdev(&aesd_device);
 
     if (result) {
+        aesd_unregister_shrinker(&aesd_device);
         kfree(aesd_device.buffer);
         unregister_chrdev_region(dev, 1);
     }
@@ -245,6 +930,7 @@ void aesd_cleanup_module(void)
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
     cdev_del(&aesd_device.cdev);
+    aesd_unregister_shrinker(&aesd_device);
 
     /**
      * TODO: cleanup AESD specific portions here as necessary
@@ -256,12 +942,12 @@ void aesd_cleanup_module(void)
     
     // Freeing entries from circular buffer
     if (aesd_device.buffer) {
-        char index = 0;
-        struct aesd_buffer_entry *entry;
-        AESD_CIRCULAR_BUFFER_FOREACH(entry, aesd_device.buffer, index) {
-            if (entry->buffptr) {
-                kfree(entry->buffptr);
-            }
+        struct aesd_buffer_entry drained[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        size_t count = aesd_circular_buffer_drain(aesd_device.buffer, drained);
+        size_t i;
+
+        for (i = 0; i < count; i++) {
+            aesd_payload_put(drained[i].buffptr);
         }
         kfree(aesd_device.buffer);
     }
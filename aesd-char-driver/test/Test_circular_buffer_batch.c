@@ -0,0 +1,159 @@
+/**
+ * @file Test_circular_buffer_batch.c
+ * @brief Unity tests for the batch, removal, drain and range APIs of aesd_circular_buffer
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unity.h"
+#include "../aesd-circular-buffer.h"
+
+#define BATCH_ENTRIES (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3)
+
+static char strings[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 2][8];
+
+/**
+ * Fill @param entries with @param count entries pointing at "e<first>\n", "e<first+1>\n", ...
+ */
+static void make_entries(struct aesd_buffer_entry *entries, size_t first, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        snprintf(strings[first + i], sizeof(strings[0]), "e%02zu\n", first + i);
+        entries[i].buffptr = strings[first + i];
+        entries[i].size = strlen(strings[first + i]);
+    }
+}
+
+void test_add_entries_wraparound(void)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry evicted[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    char copy[64];
+    size_t offset;
+    size_t i;
+
+    aesd_circular_buffer_init(&buffer);
+    make_entries(entries, 0, 7);
+    TEST_ASSERT_EQUAL_UINT(0, aesd_circular_buffer_add_entries(&buffer, entries, 7, evicted));
+    TEST_ASSERT_EQUAL_UINT(7, AESD_CIRCULAR_BUFFER_COUNT(&buffer));
+    TEST_ASSERT_FALSE(buffer.full);
+
+    // Three more than fit: the three oldest come back, oldest first
+    make_entries(entries, 7, 6);
+    TEST_ASSERT_EQUAL_UINT(3, aesd_circular_buffer_add_entries(&buffer, entries, 6, evicted));
+    for (i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_PTR(strings[i], evicted[i].buffptr);
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, AESD_CIRCULAR_BUFFER_COUNT(&buffer));
+    TEST_ASSERT_EQUAL_UINT(3, buffer.in_offs);
+    TEST_ASSERT_EQUAL_UINT(3, buffer.out_offs);
+    TEST_ASSERT_EQUAL_UINT(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 4, aesd_circular_buffer_total_size(&buffer));
+
+    // Same result as adding one at a time
+    TEST_ASSERT_EQUAL_STRING_LEN("e03\n", aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset)->buffptr, 4);
+    TEST_ASSERT_EQUAL_STRING_LEN("e12\n", aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 39, &offset)->buffptr, 4);
+    TEST_ASSERT_EQUAL_UINT(3, offset);
+
+    // A range that crosses the end of the entry array
+    memset(copy, 0, sizeof(copy));
+    TEST_ASSERT_EQUAL_UINT(10, aesd_circular_buffer_copy_range(&buffer, 26, 10, copy));
+    TEST_ASSERT_EQUAL_STRING("9\ne10\ne11\n", copy);
+}
+
+void test_add_entries_larger_than_buffer(void)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[BATCH_ENTRIES];
+    struct aesd_buffer_entry evicted[BATCH_ENTRIES];
+    size_t offset;
+    size_t i;
+
+    aesd_circular_buffer_init(&buffer);
+    make_entries(entries, 0, 4);
+    aesd_circular_buffer_add_entries(&buffer, entries, 4, NULL);
+
+    // Everything held plus the first three of the batch are evicted, in order
+    make_entries(entries, 4, BATCH_ENTRIES);
+    TEST_ASSERT_EQUAL_UINT(7, aesd_circular_buffer_add_entries(&buffer, entries, BATCH_ENTRIES, evicted));
+    for (i = 0; i < 7; i++) {
+        TEST_ASSERT_EQUAL_PTR(strings[i], evicted[i].buffptr);
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        TEST_ASSERT_EQUAL_PTR(strings[7 + i],
+                              aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, i * 4, &offset)->buffptr);
+    }
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 4, &offset));
+}
+
+void test_remove_oldest_and_drain_free(void)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry evicted;
+    struct aesd_buffer_entry removed[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t freed = 0;
+    size_t offset;
+    size_t i;
+
+    // Heap entries, freed only through what the buffer hands back
+    aesd_circular_buffer_init(&buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 2; i++) {
+        char *data = malloc(8);
+
+        TEST_ASSERT_NOT_NULL(data);
+        snprintf(data, 8, "h%02zu\n", i);
+        entry.buffptr = data;
+        entry.size = 4;
+        if (aesd_circular_buffer_add_entries(&buffer, &entry, 1, &evicted)) {
+            free((char *)evicted.buffptr);
+            freed++;
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT(2, freed);
+
+    TEST_ASSERT_EQUAL_UINT(3, aesd_circular_buffer_remove_oldest(&buffer, 3, removed));
+    TEST_ASSERT_EQUAL_STRING("h02\n", removed[0].buffptr);
+    TEST_ASSERT_EQUAL_STRING("h04\n", removed[2].buffptr);
+    for (i = 0; i < 3; i++) {
+        free((char *)removed[i].buffptr);
+    }
+    TEST_ASSERT_FALSE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 3, AESD_CIRCULAR_BUFFER_COUNT(&buffer));
+    TEST_ASSERT_EQUAL_STRING_LEN("h05\n", aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset)->buffptr, 4);
+
+    TEST_ASSERT_EQUAL_UINT(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 3, aesd_circular_buffer_drain(&buffer, removed));
+    TEST_ASSERT_EQUAL_STRING("h05\n", removed[0].buffptr);
+    TEST_ASSERT_EQUAL_STRING("h11\n", removed[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 4].buffptr);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 3; i++) {
+        free((char *)removed[i].buffptr);
+    }
+
+    // Empty again, as after init
+    TEST_ASSERT_EQUAL_UINT(0, AESD_CIRCULAR_BUFFER_COUNT(&buffer));
+    TEST_ASSERT_EQUAL_UINT(0, aesd_circular_buffer_total_size(&buffer));
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset));
+    TEST_ASSERT_EQUAL_UINT(0, aesd_circular_buffer_remove_oldest(&buffer, 1, removed));
+}
+
+void test_copy_range_stops_at_end(void)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[3];
+    char copy[16];
+
+    aesd_circular_buffer_init(&buffer);
+    make_entries(entries, 0, 3);
+    aesd_circular_buffer_add_entries(&buffer, entries, 3, NULL);
+
+    memset(copy, 0, sizeof(copy));
+    TEST_ASSERT_EQUAL_UINT(3, aesd_circular_buffer_copy_range(&buffer, 9, sizeof(copy) - 1, copy));
+    TEST_ASSERT_EQUAL_STRING("02\n", copy);
+    TEST_ASSERT_EQUAL_UINT(0, aesd_circular_buffer_copy_range(&buffer, 12, 4, copy));
+}
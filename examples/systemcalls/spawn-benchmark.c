@@ -0,0 +1,68 @@
+/**
+ * @file spawn-benchmark.c
+ * @brief Compare do_exec() launch latency for the fork and posix_spawn engines as the
+ * parent's resident set grows.
+ *
+ * Usage: spawn-benchmark [iterations] [max_rss_mb]
+ * For each parent size (0, 64, 256, ... MiB of touched heap, up to max_rss_mb) runs
+ * /bin/true iterations times with each engine and prints the mean latency per launch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "systemcalls.h"
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double mean_launch_us(enum exec_engine engine, int iterations)
+{
+    double start;
+
+    set_exec_engine(engine);
+    start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        if (!do_exec(1, "/bin/true")) {
+            fprintf(stderr, "do_exec failed\n");
+            exit(1);
+        }
+    }
+    return (now_us() - start) / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    size_t max_rss_mb = argc > 2 ? strtoul(argv[2], NULL, 0) : 1024;
+    size_t rss_mb = 0;
+    char *ballast = NULL;
+
+    printf("%10s %14s %14s\n", "rss_mb", "fork_us", "spawn_us");
+    while (rss_mb <= max_rss_mb) {
+        // Touch every page so it is resident and has to be mapped in a forked child
+        free(ballast);
+        ballast = rss_mb ? malloc(rss_mb << 20) : NULL;
+        if (rss_mb && !ballast) {
+            perror("malloc");
+            return 1;
+        }
+        if (ballast) {
+            memset(ballast, 1, rss_mb << 20);
+        }
+
+        printf("%10zu %14.1f %14.1f\n", rss_mb,
+               mean_launch_us(EXEC_ENGINE_FORK, iterations),
+               mean_launch_us(EXEC_ENGINE_SPAWN, iterations));
+        fflush(stdout);
+        rss_mb = rss_mb ? rss_mb * 4 : 64;
+    }
+    free(ballast);
+    return 0;
+}
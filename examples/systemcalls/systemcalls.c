@@ -1,4 +1,283 @@
 #include "systemcalls.h"
+#include <spawn.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+extern char **environ;
+
+static enum exec_engine exec_engine = EXEC_ENGINE_SPAWN;
+
+void set_exec_engine(enum exec_engine engine)
+{
+    exec_engine = engine;
+}
+
+enum exec_engine get_exec_engine(void)
+{
+    return exec_engine;
+}
+
+/**
+ * Translate a waitpid() @param status.
+ * @return the exit status of a child that exited normally, or -1 if it was killed by a signal
+ */
+static int exit_status_of(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Wait for @param pid and translate its exit status.
+ * @return true only if the child exited normally with status 0
+ */
+static bool wait_for_child(pid_t pid)
+{
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return exit_status_of(status) == 0;
+}
+
+/**
+ * Start @param command with fork() and execv(), redirecting stdout to @param out_fd when it is
+ * not negative.
+ * @return the child pid, or -1 on failure
+ */
+static pid_t launch_fork(char * const command[], int out_fd)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        if (out_fd >= 0) {
+            if (dup2(out_fd, STDOUT_FILENO) < 0) {
+                _exit(1);
+            }
+            close(out_fd);
+        }
+        execv(command[0], command);
+        _exit(1);
+    }
+    return pid;
+}
+
+/**
+ * Start @param command with posix_spawn(), redirecting stdout to @param out_fd when it is not
+ * negative.  glibc implements posix_spawn with clone(CLONE_VM|CLONE_VFORK), so no page tables
+ * are copied and launch latency does not depend on the parent's size.
+ * @return the child pid, or -1 on failure
+ */
+static pid_t launch_spawn(char * const command[], int out_fd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t *actionsp = NULL;
+    pid_t pid;
+    int rc;
+
+    if (out_fd >= 0) {
+        if (posix_spawn_file_actions_init(&actions) != 0) {
+            return -1;
+        }
+        actionsp = &actions;
+        if (posix_spawn_file_actions_adddup2(actionsp, out_fd, STDOUT_FILENO) != 0 ||
+            posix_spawn_file_actions_addclose(actionsp, out_fd) != 0) {
+            posix_spawn_file_actions_destroy(actionsp);
+            return -1;
+        }
+    }
+
+    rc = posix_spawn(&pid, command[0], actionsp, NULL, command, environ);
+    if (actionsp) {
+        posix_spawn_file_actions_destroy(actionsp);
+    }
+    return rc == 0 ? pid : -1;
+}
+
+/**
+ * Start @param command with the selected engine, writing stdout to @param outputfile if not NULL.
+ * @return the child pid, or -1 if the output file could not be opened or the launch failed
+ */
+static pid_t launch_command(char * const command[], const char *outputfile)
+{
+    int out_fd = -1;
+    pid_t pid;
+
+    if (outputfile) {
+        out_fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644);
+        if (out_fd < 0) {
+            return -1;
+        }
+    }
+
+    if (exec_engine == EXEC_ENGINE_FORK) {
+        pid = launch_fork(command, out_fd);
+    } else {
+        pid = launch_spawn(command, out_fd);
+    }
+
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+    return pid;
+}
+
+/**
+ * Run @param command with the selected engine and wait for it to finish.
+ */
+static bool exec_command(char * const command[], const char *outputfile)
+{
+    pid_t pid = launch_command(command, outputfile);
+
+    return pid >= 0 && wait_for_child(pid);
+}
+
+static double monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int pidfd_open_compat(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Record the exit @param status of batch entry @param req, started at @param start_ms.
+ */
+static void finish_request(struct exec_request *req, int status, double start_ms)
+{
+    req->exit_status = exit_status_of(status);
+    req->success = req->exit_status == 0;
+    req->wall_time_ms = monotonic_ms() - start_ms;
+}
+
+/**
+ * A running command of a do_exec_batch() call.
+ */
+struct batch_slot {
+    size_t index;
+    pid_t pid;
+    int pidfd;
+    double start_ms;
+};
+
+bool do_exec_batch(struct exec_request *requests, size_t count, size_t max_parallel)
+{
+    struct batch_slot *slots;
+    struct pollfd *pfds;
+    size_t next = 0, running = 0, i;
+    bool use_pidfd = true;
+    bool all_ok = true;
+
+    if (max_parallel == 0 || max_parallel > count) {
+        max_parallel = count ? count : 1;
+    }
+    // Heap allocated: max_parallel can be as large as the batch
+    slots = calloc(max_parallel, sizeof(*slots));
+    pfds = calloc(max_parallel, sizeof(*pfds));
+    if (!slots || !pfds) {
+        free(slots);
+        free(pfds);
+        for (i = 0; i < count; i++) {
+            requests[i].success = false;
+            requests[i].exit_status = -1;
+            requests[i].wall_time_ms = 0;
+        }
+        return false;
+    }
+
+    while (next < count || running > 0) {
+        // Fill every free slot before blocking
+        while (next < count && running < max_parallel) {
+            struct exec_request *req = &requests[next];
+            struct batch_slot *slot = &slots[running];
+
+            req->success = false;
+            req->exit_status = -1;
+            slot->start_ms = monotonic_ms();
+            slot->pid = launch_command(req->argv, req->outputfile);
+            if (slot->pid < 0) {
+                req->wall_time_ms = monotonic_ms() - slot->start_ms;
+                all_ok = false;
+                next++;
+                continue;
+            }
+            slot->index = next++;
+            slot->pidfd = use_pidfd ? pidfd_open_compat(slot->pid) : -1;
+            if (slot->pidfd < 0) {
+                use_pidfd = false;
+            }
+            running++;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        if (use_pidfd) {
+            // Sleep until at least one child exits, then reap exactly the ones that did
+            for (i = 0; i < running; i++) {
+                pfds[i].fd = slots[i].pidfd;
+                pfds[i].events = POLLIN;
+                pfds[i].revents = 0;
+            }
+            if (poll(pfds, running, -1) < 0) {
+                if (errno == EINTR) continue;
+                use_pidfd = false;
+                continue;
+            }
+            for (i = running; i-- > 0;) {
+                int status;
+
+                if (!(pfds[i].revents & (POLLIN | POLLHUP))) {
+                    continue;
+                }
+                if (waitpid(slots[i].pid, &status, 0) < 0) {
+                    status = -1;
+                }
+                finish_request(&requests[slots[i].index], status, slots[i].start_ms);
+                all_ok = all_ok && requests[slots[i].index].success;
+                close(slots[i].pidfd);
+                slots[i] = slots[--running];
+            }
+        } else {
+            // No pidfd support: block for any child and match it against the running slots
+            int status;
+            pid_t pid = waitpid(-1, &status, 0);
+
+            if (pid < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            for (i = 0; i < running; i++) {
+                if (slots[i].pid == pid) {
+                    finish_request(&requests[slots[i].index], status, slots[i].start_ms);
+                    all_ok = all_ok && requests[slots[i].index].success;
+                    if (slots[i].pidfd >= 0) {
+                        close(slots[i].pidfd);
+                    }
+                    slots[i] = slots[--running];
+                    break;
+                }
+            }
+        }
+    }
+    free(slots);
+    free(pfds);
+    return all_ok && running == 0;
+}
 
 /**
  * @param cmd the command to execute with system()
@@ -47,44 +326,15 @@ bool do_exec(int count, ...)
 
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
-    
-/*
- * TODO:
- *   Execute a system command by calling fork, execv(),
- *   and wait instead of system (see LSP page 161).
- *   Use the command[0] as the full path to the command to execute
- *   (first argument to execv), and use the remaining arguments
- *   as second argument to the execv() command.
- *
-*/
-
-    int pid = fork();
-
-    if (pid < 0) {
-       return false; 
-    }
-
-    if (pid == 0) {
-        execv(command[0], command);
-        exit(1);
-    }
-    else {
-        // wait(NULL);
-        int status;
-        waitpid(pid, &status, 0);
-        if(WEXITSTATUS(status) == 0) {
-            return true;
-        }
-        else {
-            return false;
-        }
-    }
     va_end(args);
 
-    // return true;
+/*
+ * Execute a system command with the engine selected by set_exec_engine(),
+ * either fork/execv/wait (see LSP page 161) or posix_spawn.
+ * Use the command[0] as the full path to the command to execute
+ * and the remaining arguments as its argument vector.
+*/
+    return exec_command(command, NULL);
 }
 
 /**
@@ -103,49 +353,12 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
-
-    // printf("")
-
+    va_end(args);
 
 /*
- * TODO
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
- *
+ * Same as do_exec(), with standard out redirected to outputfile
+ * (see https://stackoverflow.com/a/13784315/1446624).  The file is
+ * opened before the child is created and the open is checked.
 */
-    int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-        
-    int pid = fork();
-
-    if (pid < 0) {
-        return false;
-    }
-    if (pid == 0) {
-        if (dup2(fd, 1) < 0) {
-            exit(1);
-        }
-        close(fd);
-        execv(command[0], command);
-        exit(1);
-    }
-    else {
-        int status;
-        waitpid(pid, &status, 0);
-        close(fd);
-        waitpid(pid, &status, 0);
-        if(WEXITSTATUS(status) == 0) {
-            return true;
-        }
-        else {
-            return false;
-        }
-
-    }
-    va_end(args);
-
-    // return true;
+    return exec_command(command, outputfile);
 }
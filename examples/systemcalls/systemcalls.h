@@ -6,6 +6,61 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 
+/**
+ * Process creation strategy used by do_exec() and do_exec_redirect().
+ * EXEC_ENGINE_FORK copies the parent with fork() before execv(), so its cost grows with the
+ * parent's resident set.  EXEC_ENGINE_SPAWN uses posix_spawn(), which shares the parent's
+ * address space (vfork semantics) until the child execs and is independent of parent size.
+ */
+enum exec_engine {
+    EXEC_ENGINE_FORK,
+    EXEC_ENGINE_SPAWN,
+};
+
+/**
+ * Select the engine used by subsequent do_exec() and do_exec_redirect() calls.
+ * The default is EXEC_ENGINE_SPAWN.
+ */
+void set_exec_engine(enum exec_engine engine);
+
+enum exec_engine get_exec_engine(void);
+
+/**
+ * One command of a do_exec_batch() call.
+ */
+struct exec_request {
+    /**
+     * NULL terminated argument vector; argv[0] is the full path to the command
+     */
+    char * const *argv;
+    /**
+     * File to receive the command's standard output, or NULL to inherit it
+     */
+    const char *outputfile;
+    /**
+     * Set on return: the exit status, or -1 if the command could not be started or was
+     * killed by a signal
+     */
+    int exit_status;
+    /**
+     * Set on return: true if the command ran and exited with status 0
+     */
+    bool success;
+    /**
+     * Set on return: milliseconds from launch until the command was reaped
+     */
+    double wall_time_ms;
+};
+
+/**
+ * Run the @param count commands in @param requests, keeping up to @param max_parallel of them
+ * running at once with the engine selected by set_exec_engine().  Children are reaped through
+ * pidfds so only this batch's children are waited on; if pidfds are unavailable any child of
+ * the process may be reaped.
+ * @return true if every command ran and exited with status 0
+ */
+bool do_exec_batch(struct exec_request *requests, size_t count, size_t max_parallel);
+
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
@@ -0,0 +1,433 @@
+/**
+ * @file lock-benchmark.c
+ * @brief Lock contention benchmark grown from the start_thread_obtaining_mutex exercise
+ *
+ * Each thread repeatedly waits think_ns outside the lock, obtains it, holds it for hold_ns and
+ * releases it, like threadfunc() in threading.c but in a loop and with busy waits so the timing
+ * is not dominated by the scheduler.  At the end it reports throughput, fairness (per thread
+ * acquisition counts and Jain's index) and the distribution of time spent waiting for the lock.
+ * Every acquisition of the run is counted in a per thread log-linear histogram, so percentiles
+ * are exact to within one bucket (1/16 of the value) at a fixed 8 KiB per thread.
+ *
+ * Usage: lock-benchmark [-l lock|all] [-t threads] [-H hold_ns] [-T think_ns] [-d seconds]
+ * Locks: mutex, adaptive, spin, ticket, mcs, rwlock
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+#define MCS_SPIN_LIMIT 256
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void spin_ns(uint64_t ns)
+{
+    uint64_t end;
+
+    if (ns == 0) return;
+    end = now_ns() + ns;
+    while (now_ns() < end) {
+        cpu_relax();
+    }
+}
+
+/*
+ * Log-linear histogram bucket: values below HIST_SUB get a bucket each, larger ones fall into
+ * one of HIST_SUB buckets per power of two.
+ */
+static inline unsigned int hist_bucket(uint64_t v)
+{
+    unsigned int shift;
+
+    if (v < HIST_SUB) return v;
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* Smallest value that falls into @param bucket */
+static uint64_t hist_value(unsigned int bucket)
+{
+    unsigned int shift;
+
+    if (bucket < HIST_SUB) return bucket;
+    shift = bucket / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << shift;
+}
+
+/* Value at or below which a fraction @param p of the @param count samples in @param hist lie */
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t count, double p)
+{
+    uint64_t rank = (uint64_t)((count - 1) * p), seen = 0;
+
+    for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank) return hist_value(b);
+    }
+    return 0;
+}
+
+static long futex(int *uaddr, int op, int val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/* Ticket lock: FIFO, spins on a shared now-serving counter */
+struct ticket_lock {
+    unsigned int next;
+    unsigned int serving;
+};
+
+/*
+ * MCS queue lock: each waiter spins on its own node, then parks on a futex in that node, so
+ * a release touches exactly one waiter's cache line.
+ */
+struct mcs_node {
+    struct mcs_node *next;
+    int locked;
+} __attribute__((aligned(64)));
+
+struct mcs_lock {
+    struct mcs_node *tail;
+};
+
+static void mcs_acquire(struct mcs_lock *lock, struct mcs_node *me)
+{
+    struct mcs_node *pred;
+
+    me->next = NULL;
+    __atomic_store_n(&me->locked, 1, __ATOMIC_RELAXED);
+    pred = __atomic_exchange_n(&lock->tail, me, __ATOMIC_ACQ_REL);
+    if (!pred) {
+        return;
+    }
+    __atomic_store_n(&pred->next, me, __ATOMIC_RELEASE);
+    for (int i = 0; i < MCS_SPIN_LIMIT; i++) {
+        if (!__atomic_load_n(&me->locked, __ATOMIC_ACQUIRE)) return;
+        cpu_relax();
+    }
+    while (__atomic_load_n(&me->locked, __ATOMIC_ACQUIRE)) {
+        futex(&me->locked, FUTEX_WAIT_PRIVATE, 1);
+    }
+}
+
+static void mcs_release(struct mcs_lock *lock, struct mcs_node *me)
+{
+    struct mcs_node *next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE);
+
+    if (!next) {
+        struct mcs_node *expected = me;
+
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        // A successor is between the exchange and linking itself in
+        while (!(next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE))) {
+            cpu_relax();
+        }
+    }
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+    futex(&next->locked, FUTEX_WAKE_PRIVATE, 1);
+}
+
+enum lock_kind {
+    LOCK_MUTEX,
+    LOCK_ADAPTIVE,
+    LOCK_SPIN,
+    LOCK_TICKET,
+    LOCK_MCS,
+    LOCK_RWLOCK,
+    LOCK_KIND_COUNT
+};
+
+static const char *lock_names[LOCK_KIND_COUNT] = {
+    "mutex", "adaptive", "spin", "ticket", "mcs", "rwlock"
+};
+
+struct bench_lock {
+    enum lock_kind kind;
+    union {
+        pthread_mutex_t mutex;
+        pthread_spinlock_t spin;
+        struct ticket_lock ticket;
+        struct mcs_lock mcs;
+        pthread_rwlock_t rwlock;
+    } u;
+};
+
+static int bench_lock_init(struct bench_lock *lock, enum lock_kind kind)
+{
+    pthread_mutexattr_t attr;
+    int rc = 0;
+
+    memset(lock, 0, sizeof(*lock));
+    lock->kind = kind;
+    switch (kind) {
+    case LOCK_MUTEX:
+        rc = pthread_mutex_init(&lock->u.mutex, NULL);
+        break;
+    case LOCK_ADAPTIVE:
+        pthread_mutexattr_init(&attr);
+#ifdef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+        rc = pthread_mutex_init(&lock->u.mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        break;
+    case LOCK_SPIN:
+        rc = pthread_spin_init(&lock->u.spin, PTHREAD_PROCESS_PRIVATE);
+        break;
+    case LOCK_RWLOCK:
+        rc = pthread_rwlock_init(&lock->u.rwlock, NULL);
+        break;
+    default:
+        break;
+    }
+    return rc;
+}
+
+static void bench_lock_destroy(struct bench_lock *lock)
+{
+    switch (lock->kind) {
+    case LOCK_MUTEX:
+    case LOCK_ADAPTIVE:
+        pthread_mutex_destroy(&lock->u.mutex);
+        break;
+    case LOCK_SPIN:
+        pthread_spin_destroy(&lock->u.spin);
+        break;
+    case LOCK_RWLOCK:
+        pthread_rwlock_destroy(&lock->u.rwlock);
+        break;
+    default:
+        break;
+    }
+}
+
+static void bench_lock_acquire(struct bench_lock *lock, struct mcs_node *node)
+{
+    unsigned int ticket;
+
+    switch (lock->kind) {
+    case LOCK_MUTEX:
+    case LOCK_ADAPTIVE:
+        pthread_mutex_lock(&lock->u.mutex);
+        break;
+    case LOCK_SPIN:
+        pthread_spin_lock(&lock->u.spin);
+        break;
+    case LOCK_TICKET:
+        ticket = __atomic_fetch_add(&lock->u.ticket.next, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&lock->u.ticket.serving, __ATOMIC_ACQUIRE) != ticket) {
+            cpu_relax();
+        }
+        break;
+    case LOCK_MCS:
+        mcs_acquire(&lock->u.mcs, node);
+        break;
+    case LOCK_RWLOCK:
+        // aesdsocket writers need exclusive access, so measure the write side
+        pthread_rwlock_wrlock(&lock->u.rwlock);
+        break;
+    default:
+        break;
+    }
+}
+
+static void bench_lock_release(struct bench_lock *lock, struct mcs_node *node)
+{
+    switch (lock->kind) {
+    case LOCK_MUTEX:
+    case LOCK_ADAPTIVE:
+        pthread_mutex_unlock(&lock->u.mutex);
+        break;
+    case LOCK_SPIN:
+        pthread_spin_unlock(&lock->u.spin);
+        break;
+    case LOCK_TICKET:
+        __atomic_store_n(&lock->u.ticket.serving, lock->u.ticket.serving + 1, __ATOMIC_RELEASE);
+        break;
+    case LOCK_MCS:
+        mcs_release(&lock->u.mcs, node);
+        break;
+    case LOCK_RWLOCK:
+        pthread_rwlock_unlock(&lock->u.rwlock);
+        break;
+    default:
+        break;
+    }
+}
+
+struct bench_config {
+    int threads;
+    uint64_t hold_ns;
+    uint64_t think_ns;
+    double seconds;
+};
+
+/**
+ * Per thread state, the loop counterpart of struct thread_data in threading.h
+ */
+struct bench_thread {
+    pthread_t thread;
+    struct bench_lock *lock;
+    const struct bench_config *config;
+    volatile bool *stop;
+    struct mcs_node node;
+    uint64_t acquisitions;
+    uint64_t max_wait_ns;
+    uint64_t wait_hist[HIST_BUCKETS];
+};
+
+static void *bench_threadfunc(void *arg)
+{
+    struct bench_thread *t = arg;
+
+    while (!*t->stop) {
+        uint64_t start, wait;
+
+        spin_ns(t->config->think_ns);
+        start = now_ns();
+        bench_lock_acquire(t->lock, &t->node);
+        wait = now_ns() - start;
+        t->wait_hist[hist_bucket(wait)]++;
+        if (wait > t->max_wait_ns) t->max_wait_ns = wait;
+        spin_ns(t->config->hold_ns);
+        t->acquisitions++;
+        bench_lock_release(t->lock, &t->node);
+    }
+    return NULL;
+}
+
+static int run_benchmark(enum lock_kind kind, const struct bench_config *config)
+{
+    struct bench_lock lock;
+    struct bench_thread *threads;
+    volatile bool stop = false;
+    uint64_t total = 0, min_acq = UINT64_MAX, max_acq = 0, start, elapsed;
+    uint64_t hist[HIST_BUCKETS] = { 0 }, max_wait = 0;
+    double sum_sq = 0;
+    int i;
+
+    if (bench_lock_init(&lock, kind) != 0) {
+        fprintf(stderr, "failed to initialize %s\n", lock_names[kind]);
+        return -1;
+    }
+    threads = calloc(config->threads, sizeof(*threads));
+    if (!threads) {
+        return -1;
+    }
+    for (i = 0; i < config->threads; i++) {
+        threads[i].lock = &lock;
+        threads[i].config = config;
+        threads[i].stop = &stop;
+    }
+
+    start = now_ns();
+    for (i = 0; i < config->threads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, bench_threadfunc, &threads[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    usleep((useconds_t)(config->seconds * 1e6));
+    stop = true;
+    for (i = 0; i < config->threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    elapsed = now_ns() - start;
+
+    for (i = 0; i < config->threads; i++) {
+        uint64_t n = threads[i].acquisitions;
+
+        total += n;
+        sum_sq += (double)n * n;
+        if (n < min_acq) min_acq = n;
+        if (n > max_acq) max_acq = n;
+        if (threads[i].max_wait_ns > max_wait) max_wait = threads[i].max_wait_ns;
+        for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+            hist[b] += threads[i].wait_hist[b];
+        }
+    }
+
+#define PCT(p) (total ? hist_percentile(hist, total, (p)) : 0)
+    printf("%-9s %12.0f %10" PRIu64 " %10" PRIu64 " %7.3f %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %11" PRIu64 "\n",
+           lock_names[kind], total / (elapsed / 1e9), min_acq, max_acq,
+           sum_sq > 0 ? ((double)total * total) / (config->threads * sum_sq) : 0.0,
+           PCT(0.5), PCT(0.99), PCT(0.999), max_wait);
+#undef PCT
+
+    free(threads);
+    bench_lock_destroy(&lock);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-l mutex|adaptive|spin|ticket|mcs|rwlock|all] [-t threads] "
+            "[-H hold_ns] [-T think_ns] [-d seconds]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config config = { .threads = 4, .hold_ns = 100, .think_ns = 500, .seconds = 2.0 };
+    const char *which = "all";
+    int c, kind;
+
+    while ((c = getopt(argc, argv, "l:t:H:T:d:h")) != -1) {
+        switch (c) {
+        case 'l': which = optarg; break;
+        case 't': config.threads = atoi(optarg); break;
+        case 'H': config.hold_ns = strtoull(optarg, NULL, 0); break;
+        case 'T': config.think_ns = strtoull(optarg, NULL, 0); break;
+        case 'd': config.seconds = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (config.threads < 1 || config.seconds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("threads=%d hold_ns=%" PRIu64 " think_ns=%" PRIu64 " seconds=%.1f\n",
+           config.threads, config.hold_ns, config.think_ns, config.seconds);
+    printf("%-9s %12s %10s %10s %7s %9s %9s %9s %11s\n", "lock", "acq/s", "min_acq", "max_acq",
+           "jain", "p50_ns", "p99_ns", "p999_ns", "max_ns");
+    for (kind = 0; kind < LOCK_KIND_COUNT; kind++) {
+        if (strcmp(which, "all") == 0 || strcmp(which, lock_names[kind]) == 0) {
+            run_benchmark(kind, &config);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,401 @@
+/**
+ * @file finder.c
+ * @brief Native replacement for finder.sh
+ *
+ * Usage: finder <filesdir> <searchstr> [threads]
+ * Prints the same line as finder.sh: the number of regular files below filesdir and the
+ * number of lines in them matching searchstr, a basic regular expression as for grep.
+ *
+ * The tree is walked once by a pool of threads.  Each thread owns a stack of directories to
+ * visit and steals half of another thread's stack when its own runs dry.  Directories are
+ * read with getdents64, files are opened relative to their directory with openat, and file
+ * contents are scanned from mmap or a large buffer.  A searchstr without BRE metacharacters
+ * is a fixed string: candidates are found with memchr on its first byte, checked against its
+ * last byte and only then compared in full.  Anything else goes through regexec.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <regex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define DENTS_BUFFER_SIZE (64 * 1024)
+#define READ_BUFFER_SIZE (1024 * 1024)
+#define MMAP_THRESHOLD (256 * 1024)
+#define MAX_THREADS 64
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dir_stack {
+    pthread_mutex_t lock;
+    char **paths;
+    size_t count;
+    size_t capacity;
+};
+
+struct walker {
+    pthread_t thread;
+    struct dir_stack stack;
+    unsigned long long files;
+    unsigned long long matches;
+    char *read_buffer;
+    char *dents_buffer;
+    regex_t regex;        /* Own copy: glibc serializes regexec calls on one regex_t */
+};
+
+static struct walker walkers[MAX_THREADS];
+static int nwalkers;
+static const char *needle;
+static size_t needle_len;
+static bool use_regex;    /* The needle has BRE metacharacters */
+static bool match_nothing;  /* The needle is not a valid BRE */
+
+/* Directories queued or being read; the walk is over when this drops to zero */
+static long pending_dirs;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+/* Bumped under idle_lock whenever a directory is queued, so idle walkers can't miss it */
+static unsigned long queued_seq;
+
+static void dir_stack_push(struct dir_stack *stack, char *path)
+{
+    pthread_mutex_lock(&stack->lock);
+    if (stack->count == stack->capacity) {
+        size_t capacity = stack->capacity ? stack->capacity * 2 : 64;
+        char **grown = realloc(stack->paths, capacity * sizeof(char *));
+        if (!grown) {
+            perror("realloc");
+            exit(1);
+        }
+        stack->paths = grown;
+        stack->capacity = capacity;
+    }
+    stack->paths[stack->count++] = path;
+    pthread_mutex_unlock(&stack->lock);
+}
+
+static char *dir_stack_pop(struct dir_stack *stack)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&stack->lock);
+    if (stack->count > 0) {
+        path = stack->paths[--stack->count];
+    }
+    pthread_mutex_unlock(&stack->lock);
+    return path;
+}
+
+/**
+ * Move half of another walker's directories (oldest first, which tend to be the largest
+ * subtrees) onto @param self's stack.
+ * @return true if anything was stolen
+ */
+static bool steal_work(struct walker *self)
+{
+    for (int i = 0; i < nwalkers; i++) {
+        struct walker *victim = &walkers[(self - walkers + 1 + i) % nwalkers];
+        char **taken = NULL;
+        size_t n = 0;
+
+        if (victim == self) continue;
+        pthread_mutex_lock(&victim->stack.lock);
+        if (victim->stack.count > 0) {
+            n = (victim->stack.count + 1) / 2;
+            taken = malloc(n * sizeof(char *));
+            if (taken) {
+                memcpy(taken, victim->stack.paths, n * sizeof(char *));
+                memmove(victim->stack.paths, victim->stack.paths + n,
+                        (victim->stack.count - n) * sizeof(char *));
+                victim->stack.count -= n;
+            } else {
+                n = 0;
+            }
+        }
+        pthread_mutex_unlock(&victim->stack.lock);
+        if (n) {
+            for (size_t j = 0; j < n; j++) dir_stack_push(&self->stack, taken[j]);
+            free(taken);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @return the first occurrence of the fixed string needle in [@param p, @param end), or NULL
+ */
+static const char *find_fixed(const char *p, const char *end)
+{
+    const char first = needle[0], last = needle[needle_len - 1];
+
+    while ((size_t)(end - p) >= needle_len) {
+        p = memchr(p, first, end - p - needle_len + 1);
+        if (!p) return NULL;
+        if (p[needle_len - 1] == last && memcmp(p + 1, needle + 1, needle_len - 1) == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+/**
+ * @return the start of the first match of @param self's regex in [@param p, @param end),
+ * or NULL
+ */
+static const char *find_regex(struct walker *self, const char *p, const char *end)
+{
+    regmatch_t match = { .rm_so = 0, .rm_eo = end - p };
+
+    if (regexec(&self->regex, p, 1, &match, REG_STARTEND) != 0) return NULL;
+    return p + match.rm_so;
+}
+
+/**
+ * Count lines of @param data matching the needle.  Each hit counts its line once and the
+ * search resumes after the end of that line.
+ */
+static unsigned long long count_matching_lines(struct walker *self, const char *data, size_t len)
+{
+    unsigned long long lines = 0;
+    const char *p = data, *end = data + len;
+
+    if (match_nothing) return 0;
+    if (needle_len == 0) {
+        // Like grep '', every line matches, including an unterminated last line
+        for (const char *nl; p < end && (nl = memchr(p, '\n', end - p)); p = nl + 1) lines++;
+        return lines + (p < end);
+    }
+    while (p < end) {
+        const char *hit = use_regex ? find_regex(self, p, end) : find_fixed(p, end);
+        const char *nl;
+
+        // A regex can match the empty string past the final newline, where there is no line
+        if (!hit || (hit == end && end[-1] == '\n')) break;
+        lines++;
+        nl = memchr(hit, '\n', end - hit);
+        if (!nl) break;
+        p = nl + 1;
+    }
+    return lines;
+}
+
+static unsigned long long scan_file(struct walker *self, int dirfd, const char *name)
+{
+    unsigned long long lines = 0;
+    struct stat st;
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+
+    if (st.st_size >= MMAP_THRESHOLD) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            lines = count_matching_lines(self, map, st.st_size);
+            munmap(map, st.st_size);
+            close(fd);
+            return lines;
+        }
+    }
+
+    // Read in large chunks, carrying an unfinished last line over into the next chunk
+    size_t carry = 0;
+    for (;;) {
+        ssize_t n = read(fd, self->read_buffer + carry, READ_BUFFER_SIZE - carry);
+        size_t avail, complete;
+        const char *last_nl;
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (carry) lines += count_matching_lines(self, self->read_buffer, carry);
+            break;
+        }
+        avail = carry + n;
+        last_nl = memrchr(self->read_buffer, '\n', avail);
+        if (!last_nl) {
+            if (avail < READ_BUFFER_SIZE) {
+                carry = avail;
+                continue;
+            }
+            // A line longer than the buffer; scan what we have and keep an overlap for the needle
+            complete = avail - (needle_len ? needle_len - 1 : 0);
+        } else {
+            complete = last_nl - self->read_buffer + 1;
+        }
+        lines += count_matching_lines(self, self->read_buffer, complete);
+        carry = avail - complete;
+        memmove(self->read_buffer, self->read_buffer + complete, carry);
+    }
+    close(fd);
+    return lines;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char *path = malloc(dlen + nlen + 2);
+
+    if (!path) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(path, dir, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, nlen + 1);
+    return path;
+}
+
+static void walk_directory(struct walker *self, const char *path)
+{
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dirfd < 0) return;
+    for (;;) {
+        long n = syscall(SYS_getdents64, dirfd, self->dents_buffer, DENTS_BUFFER_SIZE);
+
+        if (n <= 0) break;
+        for (long off = 0; off < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(self->dents_buffer + off);
+            unsigned char type = d->d_type;
+
+            off += d->d_reclen;
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0' ||
+                                        (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+                continue;
+            }
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+
+                if (fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_DIR) {
+                __atomic_add_fetch(&pending_dirs, 1, __ATOMIC_RELAXED);
+                dir_stack_push(&self->stack, join_path(path, d->d_name));
+                pthread_mutex_lock(&idle_lock);
+                __atomic_add_fetch(&queued_seq, 1, __ATOMIC_RELEASE);
+                pthread_cond_signal(&idle_cond);
+                pthread_mutex_unlock(&idle_lock);
+            } else if (type == DT_REG) {
+                self->files++;
+                self->matches += scan_file(self, dirfd, d->d_name);
+            }
+        }
+    }
+    close(dirfd);
+}
+
+static void *walker_main(void *arg)
+{
+    struct walker *self = arg;
+
+    for (;;) {
+        unsigned long seq = __atomic_load_n(&queued_seq, __ATOMIC_ACQUIRE);
+        char *path = dir_stack_pop(&self->stack);
+
+        if (!path && steal_work(self)) continue;
+        if (path) {
+            walk_directory(self, path);
+            free(path);
+            if (__atomic_sub_fetch(&pending_dirs, 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_mutex_lock(&idle_lock);
+                pthread_cond_broadcast(&idle_cond);
+                pthread_mutex_unlock(&idle_lock);
+            }
+            continue;
+        }
+        // Nothing to do: sleep until more directories appear or the walk completes
+        pthread_mutex_lock(&idle_lock);
+        if (__atomic_load_n(&pending_dirs, __ATOMIC_ACQUIRE) == 0) {
+            pthread_mutex_unlock(&idle_lock);
+            break;
+        }
+        // Only sleep if nothing was queued since this walker last looked
+        if (queued_seq == seq) pthread_cond_wait(&idle_cond, &idle_lock);
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long files = 0, matches = 0;
+    struct stat st;
+    long ncpu;
+
+    if (argc != 3 && argc != 4) {
+        printf("Error: You must provide two arguments: <filesdir> and <searchstr>\n");
+        return 1;
+    }
+    if (stat(argv[1], &st) < 0 || !S_ISDIR(st.st_mode)) {
+        printf("Error: %s is not a valid directory or does not exist.\n", argv[1]);
+        return 1;
+    }
+    needle = argv[2];
+    needle_len = strlen(needle);
+    // In a BRE only these are special; everything else, + ? | ( ) { } included, is literal
+    use_regex = needle[strcspn(needle, ".[*^$\\")] != '\0';
+
+    ncpu = argc == 4 ? atol(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    nwalkers = ncpu < 1 ? 1 : ncpu > MAX_THREADS ? MAX_THREADS : ncpu;
+
+    for (int i = 0; i < nwalkers; i++) {
+        pthread_mutex_init(&walkers[i].stack.lock, NULL);
+        walkers[i].read_buffer = malloc(READ_BUFFER_SIZE);
+        walkers[i].dents_buffer = malloc(DENTS_BUFFER_SIZE);
+        if (!walkers[i].read_buffer || !walkers[i].dents_buffer) {
+            perror("malloc");
+            return 1;
+        }
+        if (use_regex) {
+            int rc = regcomp(&walkers[i].regex, needle, REG_NEWLINE);
+
+            if (rc != 0) {
+                char message[256];
+
+                // grep rejects the pattern too, so finder.sh counts no matching lines
+                regerror(rc, &walkers[i].regex, message, sizeof(message));
+                fprintf(stderr, "Invalid search string: %s\n", message);
+                match_nothing = true;
+                use_regex = false;
+            }
+        }
+    }
+    pending_dirs = 1;
+    dir_stack_push(&walkers[0].stack, strdup(argv[1]));
+
+    for (int i = 0; i < nwalkers; i++) {
+        if (pthread_create(&walkers[i].thread, NULL, walker_main, &walkers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (int i = 0; i < nwalkers; i++) {
+        pthread_join(walkers[i].thread, NULL);
+        files += walkers[i].files;
+        matches += walkers[i].matches;
+    }
+
+    printf("The number of files are %llu and the number of matching lines are %llu\n", files, matches);
+    return 0;
+}
@@ -1,45 +1,342 @@
-#include <fcntl.h>
-#include <string.h>
-#include <stdio.h>
-#include <syslog.h> 
-#include <unistd.h>
-
-
-int main(int argc, char *argv[])
-{
-    int fileFd;
-    size_t numRead;
-
-    openlog(NULL, 0, LOG_USER);
-
-    if (argc != 3 || strcmp(argv[1], "--help") == 0) {
-        printf("you should provide two arguments\n");
-        syslog(LOG_ERR, "you should provide two arguments");
-        closelog();
-        return 1;
-    }
-
-    fileFd = open(argv[1], O_WRONLY | O_CREAT, 0644);
-
-    if (fileFd == -1) {
-        printf("error opening file %s\n", argv[1]);
-        syslog(LOG_ERR, "error opening file %s", argv[1]);
-        closelog();
-        return 1;
-    }
-
-    numRead = write(fileFd, argv[2], strlen(argv[2]));
-
-    if(numRead < 0) {
-        printf("error writing to file %s\n", argv[1]);
-        syslog(LOG_ERR, "error writing to file %s", argv[1]);
-        close(fileFd);
-        closelog();
-        return 1;
-    }
-
-    syslog(LOG_DEBUG ,  "Writing %s to %s", argv[2], argv[1]);
-
-    close(fileFd);
-    return 0;
-}
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <syslog.h> 
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BULK_BUFFER_SIZE (1024 * 1024)
+#define BULK_ALIGNMENT 4096
+
+/**
+ * Write all @param len bytes of @param buf to @param fd, retrying on short writes and EINTR.
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Parse a size with an optional K, M or G suffix.
+ * @return the size in bytes, or -1 if @param str is not a valid size
+ */
+static long long parse_size(const char *str)
+{
+    char *end;
+    long long value = strtoll(str, &end, 10);
+
+    if (end == str || value < 0) return -1;
+    switch (*end) {
+    case 'k': case 'K': value <<= 10; end++; break;
+    case 'm': case 'M': value <<= 20; end++; break;
+    case 'g': case 'G': value <<= 30; end++; break;
+    default: break;
+    }
+    return *end == '\0' ? value : -1;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Write one chunk to the destination.  O_DIRECT needs block aligned lengths, so an unaligned
+ * tail is written after switching O_DIRECT off.
+ */
+static int write_chunk(int fd, const char *buf, size_t len, int *direct)
+{
+    if (*direct && len % BULK_ALIGNMENT) {
+        size_t aligned = len - len % BULK_ALIGNMENT;
+
+        if (aligned && write_all(fd, buf, aligned) < 0) return -1;
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) < 0) return -1;
+        *direct = 0;
+        buf += aligned;
+        len -= aligned;
+    }
+    return write_all(fd, buf, len);
+}
+
+/**
+ * Copy @param size bytes (or until end of file if negative) from @param src_fd with
+ * copy_file_range(), falling back to read/write when the kernel or filesystem can't.
+ * @return bytes copied, or -1 on failure
+ */
+static long long copy_from_file(int src_fd, int dst_fd, long long size, char *buf, int *direct)
+{
+    long long copied = 0;
+    int use_cfr = !*direct;
+
+    while (size < 0 || copied < size) {
+        size_t want = BULK_BUFFER_SIZE;
+        ssize_t n;
+
+        if (size >= 0 && (long long)want > size - copied) want = size - copied;
+        if (use_cfr) {
+            n = copy_file_range(src_fd, NULL, dst_fd, NULL, size < 0 ? 1 << 30 : (size_t)(size - copied), 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                          errno == EOPNOTSUPP)) {
+                use_cfr = 0;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return -1;
+            if (n == 0) break;
+        } else {
+            n = read(src_fd, buf, want);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return -1;
+            if (n == 0) break;
+            if (write_chunk(dst_fd, buf, n, direct) < 0) return -1;
+        }
+        copied += n;
+    }
+    return copied;
+}
+
+/**
+ * Fill @param len bytes of @param buf with @param pattern repeated, starting @param phase bytes
+ * into the pattern.
+ */
+static void fill_pattern(char *buf, size_t len, const char *pattern, size_t plen, size_t phase)
+{
+    size_t off = 0;
+
+    while (off < len) {
+        size_t run = plen - phase;
+
+        if (run > len - off) run = len - off;
+        memcpy(buf + off, pattern + phase, run);
+        off += run;
+        phase = 0;
+    }
+}
+
+static size_t gcd(size_t a, size_t b)
+{
+    while (b) {
+        size_t t = a % b;
+
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/**
+ * Fill the destination from stdin (until @param size bytes or end of input) or by repeating
+ * @param pattern up to @param size bytes.
+ * @return bytes written, or -1 on failure
+ */
+static long long write_stream(int dst_fd, const char *pattern, long long size, char *buf, int *direct)
+{
+    long long written = 0;
+    size_t fill = 0;
+
+    if (pattern) {
+        size_t plen = strlen(pattern);
+        size_t period = plen / gcd(plen, BULK_ALIGNMENT) * BULK_ALIGNMENT;
+        // Chunks of whole lcm(plen, BULK_ALIGNMENT) periods start at the same pattern phase and
+        // stay aligned for O_DIRECT, so the buffer is filled once
+        int fixed = period <= BULK_BUFFER_SIZE;
+        size_t usable = fixed ? BULK_BUFFER_SIZE - BULK_BUFFER_SIZE % period : BULK_BUFFER_SIZE;
+
+        if (fixed) fill_pattern(buf, usable, pattern, plen, 0);
+        while (written < size) {
+            size_t len = usable;
+
+            if ((long long)len > size - written) len = size - written;
+            // Otherwise refill at the phase this chunk starts from
+            if (!fixed) fill_pattern(buf, len, pattern, plen, written % plen);
+            if (write_chunk(dst_fd, buf, len, direct) < 0) return -1;
+            written += len;
+        }
+        return written;
+    }
+
+    for (;;) {
+        size_t want = BULK_BUFFER_SIZE - fill;
+        ssize_t n;
+
+        if (size >= 0 && (long long)want > size - written - (long long)fill) want = size - written - fill;
+        n = want ? read(STDIN_FILENO, buf + fill, want) : 0;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        fill += n;
+        // Only write full buffers until input ends so O_DIRECT stays aligned
+        if (fill == BULK_BUFFER_SIZE || n == 0) {
+            if (fill && write_chunk(dst_fd, buf, fill, direct) < 0) return -1;
+            written += fill;
+            fill = 0;
+            if (n == 0) break;
+        }
+    }
+    return written;
+}
+
+static void bulk_usage(const char *prog)
+{
+    printf("usage: %s [-s size[K|M|G]] [-p pattern | -i srcfile] [-D] [-F] <file>\n"
+           "  reads stdin unless -p or -i is given; -D uses O_DIRECT, -F preallocates\n", prog);
+}
+
+/**
+ * High throughput mode: write a large file from stdin, a repeated pattern or another file
+ * and report the achieved rate.
+ */
+static int bulk_main(int argc, char *argv[])
+{
+    const char *pattern = NULL, *src_path = NULL, *path;
+    long long size = -1, written;
+    int direct = 0, prealloc = 0, fd, src_fd = -1, c, flags;
+    char *buf;
+    double start, elapsed;
+
+    while ((c = getopt(argc, argv, "s:p:i:DF")) != -1) {
+        switch (c) {
+        case 's':
+            size = parse_size(optarg);
+            if (size < 0) {
+                printf("invalid size %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p': pattern = optarg; break;
+        case 'i': src_path = optarg; break;
+        case 'D': direct = 1; break;
+        case 'F': prealloc = 1; break;
+        default:
+            bulk_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || (pattern && (src_path || size < 0 || !*pattern))) {
+        bulk_usage(argv[0]);
+        return 1;
+    }
+    path = argv[optind];
+
+    if (src_path) {
+        struct stat st;
+
+        src_fd = open(src_path, O_RDONLY);
+        if (src_fd < 0 || fstat(src_fd, &st) < 0) {
+            printf("error opening file %s\n", src_path);
+            syslog(LOG_ERR, "error opening file %s", src_path);
+            if (src_fd >= 0) close(src_fd);
+            return 1;
+        }
+        if (size < 0 && S_ISREG(st.st_mode)) size = st.st_size;
+    }
+
+    flags = O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0);
+    fd = open(path, flags, 0644);
+    if (fd < 0 && direct && errno == EINVAL) {
+        // Filesystem without O_DIRECT support (tmpfs); fall back to buffered writes
+        direct = 0;
+        fd = open(path, flags & ~O_DIRECT, 0644);
+    }
+    if (fd < 0) {
+        printf("error opening file %s\n", path);
+        syslog(LOG_ERR, "error opening file %s", path);
+        return 1;
+    }
+    if (prealloc && size > 0 && fallocate(fd, 0, 0, size) < 0) {
+        syslog(LOG_WARNING, "fallocate on %s failed: %s", path, strerror(errno));
+    }
+    if (posix_memalign((void **)&buf, BULK_ALIGNMENT, BULK_BUFFER_SIZE) != 0) {
+        printf("out of memory\n");
+        close(fd);
+        return 1;
+    }
+
+    start = now_seconds();
+    if (src_fd >= 0) {
+        written = copy_from_file(src_fd, fd, size, buf, &direct);
+    } else {
+        written = write_stream(fd, pattern, size, buf, &direct);
+    }
+    if (written >= 0 && fsync(fd) < 0 && errno != EINVAL) {
+        written = -1;
+    }
+    elapsed = now_seconds() - start;
+
+    free(buf);
+    if (src_fd >= 0) close(src_fd);
+    if (written < 0) {
+        printf("error writing to file %s: %s\n", path, strerror(errno));
+        syslog(LOG_ERR, "error writing to file %s: %s", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    // Drop preallocated space beyond what was actually written
+    if (ftruncate(fd, written) < 0) {
+        syslog(LOG_WARNING, "ftruncate on %s failed: %s", path, strerror(errno));
+    }
+    close(fd);
+
+    printf("wrote %lld bytes to %s in %.3f s (%.1f MB/s)\n", written, path, elapsed,
+           elapsed > 0 ? written / elapsed / 1e6 : 0.0);
+    syslog(LOG_DEBUG, "Wrote %lld bytes to %s", written, path);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int fileFd;
+
+    openlog(NULL, 0, LOG_USER);
+
+    if (argc > 1 && argv[1][0] == '-' && strcmp(argv[1], "--help") != 0) {
+        int rc = bulk_main(argc, argv);
+        closelog();
+        return rc;
+    }
+
+    if (argc != 3 || strcmp(argv[1], "--help") == 0) {
+        printf("you should provide two arguments\n");
+        syslog(LOG_ERR, "you should provide two arguments");
+        closelog();
+        return 1;
+    }
+
+    fileFd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fileFd == -1) {
+        printf("error opening file %s\n", argv[1]);
+        syslog(LOG_ERR, "error opening file %s", argv[1]);
+        closelog();
+        return 1;
+    }
+
+    if (write_all(fileFd, argv[2], strlen(argv[2])) < 0) {
+        printf("error writing to file %s\n", argv[1]);
+        syslog(LOG_ERR, "error writing to file %s", argv[1]);
+        close(fileFd);
+        closelog();
+        return 1;
+    }
+
+    syslog(LOG_DEBUG ,  "Writing %s to %s", argv[2], argv[1]);
+
+    close(fileFd);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -14,20 +15,44 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <sys/queue.h>
+#include <poll.h>
+#include <sched.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <limits.h>
 
-#ifndef USE_AESD_CHAR_DEVICE
-#define USE_AESD_CHAR_DEVICE 1  // Default to 1
-#endif
+#include "aesdsocket.h"
+#include "snapshot.h"
+#include "datastore.h"
+#include "client.h"
+#include "trace.h"
+#include "fiber.h"
+#include "tierstore.h"
+#include "replication.h"
+#include "handover.h"
+#include "fanout.h"
 
-#define MAX 80
 #define PORT 9000
+#define DEFAULT_BACKLOG 128
+#define MAX_ACCEPTORS 64
+#define DEFAULT_DRAIN_MS 5000
 #define SIZE 50
 #define TIMESTAMP_INTERVAL 10
+#define DEFAULT_HOT_BYTES (1024 * 1024)
+#define DEFAULT_SEGMENT_BYTES (16 * 1024 * 1024)
+#define MAX_WORKERS 256
+// Set in the environment of an exec'd worker: its index and the descriptor its state comes on
+#define WORKER_ENV "AESDSOCKET_WORKER"
 
 volatile sig_atomic_t terminate_flag = false;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+int shutdown_efd = -1;
+static char **saved_argv;  // To exec workers with
 
-// Global file path - determined at compile time
+// Global file path - default determined at compile time, -o overrides it
 #if USE_AESD_CHAR_DEVICE
     const char* data_file_path = "/dev/aesdchar";
 #else
@@ -37,217 +62,834 @@ pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 struct thread_node {
     pthread_t thread;     // Store thread ID here
     int complete;         // Flag to mark thread completion
+    int connfd;           // Client socket handled by the thread
+    bool binary;          // Accepted on the binary port
     SLIST_ENTRY(thread_node) entries;  // Macro for list linkage
 };
 SLIST_HEAD(thread_list, thread_node) head;  // Define list head type
+pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Listener configuration, set from the command line.
+ */
+struct listen_config {
+    int port;
+    int backlog;
+    int acceptors;        // Number of SO_REUSEPORT listeners, each with its own accept thread
+    bool steer_cpu;       // Run each connection's thread on its acceptor's CPU
+    bool binary;          // Connections use binary framing from the start
+};
+
+struct acceptor {
+    pthread_t thread;
+    int listen_fd;
+    int cpu;              // CPU the acceptor is pinned to, or -1
+    const struct listen_config *config;
+};
+
+static volatile sig_atomic_t trace_dump_flag = false;
+
+// Serve connections on fiber schedulers instead of a thread each (-f)
+static bool use_fibers = false;
+
+struct fiber_client {
+    int connfd;
+    bool binary;
+};
+
+/**
+ * Run-time settings of one serving process, the supervisor's or a worker's.
+ */
+struct serve_config {
+    struct acceptor *acceptors;
+    int nacceptors;
+    int fiber_schedulers;  // With use_fibers
+    bool pin_schedulers;
+    long drain_ms;
+    bool tail_log;        // Publish to subscribers by tailing the shared log (fanout.h)
+};
 
 static void signal_handler(int signal_number) {
     if (signal_number == SIGINT || signal_number == SIGTERM) {
         terminate_flag = true;
+    } else if (signal_number == SIGUSR1) {
+        trace_dump_flag = true;
     }
 }
 
 #if !USE_AESD_CHAR_DEVICE
-void* timestamp_thread(void* args) {
-    time_t t;
-    struct tm *tmp;
-    char time_buffer[SIZE];
-    char output_buffer[SIZE + 20]; // For "timestamp:" prefix and newline
-    
-    while(!terminate_flag) {
-        time(&t);
-        tmp = localtime(&t);
-        
+/**
+ * Format the timestamp line for @param now into @param out, reusing the previous result when
+ * called again within the same second so localtime/strftime run at most once per second.
+ * @return the length of the line
+ */
+static size_t format_timestamp(time_t now, char *out, size_t out_size) {
+    static time_t cached_time = (time_t)-1;
+    static char cached_line[SIZE + 20]; // For "timestamp:" prefix and newline
+    static size_t cached_len;
+
+    if (now != cached_time) {
+        char time_buffer[SIZE];
+        struct tm tm;
+
+        localtime_r(&now, &tm);
         // Format according to RFC 2822
-        strftime(time_buffer, sizeof(time_buffer), "%a, %d %b %Y %T %z", tmp);
-        
-        // Create timestamp message
-        snprintf(output_buffer, sizeof(output_buffer), "timestamp:%s\n", time_buffer);
-        
-        // Write timestamp to file with mutex protection
-        pthread_mutex_lock(&mutex);
-        int fd = open(data_file_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd >= 0) {
-            if (write(fd, output_buffer, strlen(output_buffer)) < 0) {
-                perror("Error writing timestamp");
-            }
-            close(fd);
+        strftime(time_buffer, sizeof(time_buffer), "%a, %d %b %Y %T %z", &tm);
+        cached_len = snprintf(cached_line, sizeof(cached_line), "timestamp:%s\n", time_buffer);
+        cached_time = now;
+    }
+    if (cached_len >= out_size) {
+        cached_len = out_size - 1;
+    }
+    memcpy(out, cached_line, cached_len + 1);
+    return cached_len;
+}
+
+/**
+ * Append a timestamp line every TIMESTAMP_INTERVAL seconds, driven by a timerfd.  The thread
+ * also waits on shutdown_efd so it exits as soon as the server is asked to stop, instead of
+ * finishing a sleep().
+ */
+void* timestamp_thread(void* args) {
+    char output_buffer[SIZE + 20];
+    struct itimerspec interval = {
+        .it_interval = { .tv_sec = TIMESTAMP_INTERVAL },
+        .it_value = { .tv_nsec = 1 },  // First timestamp right away
+    };
+    struct pollfd pfds[2];
+    int timer_fd;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd < 0 || timerfd_settime(timer_fd, 0, &interval, NULL) < 0) {
+        perror("timerfd setup failed");
+        if (timer_fd >= 0) close(timer_fd);
+        return NULL;
+    }
+    pfds[0].fd = timer_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = shutdown_efd;
+    pfds[1].events = POLLIN;
+
+    while (!terminate_flag) {
+        uint64_t expirations;
+        size_t len;
+
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed in timestamp_thread");
+            break;
         }
-        pthread_mutex_unlock(&mutex);
-        
-        // Sleep for 10 seconds
-        sleep(TIMESTAMP_INTERVAL);
+        if (pfds[1].revents) {
+            break;
+        }
+        if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            continue;
+        }
+
+        len = format_timestamp(time(NULL), output_buffer, sizeof(output_buffer));
+
+        // Append through the same shared descriptor as client packets
+        datastore_lock();
+        if (datastore_append(output_buffer, len) < 0) {
+            perror("Error writing timestamp");
+        }
+        datastore_unlock();
     }
-    
+
+    close(timer_fd);
     return NULL;
 }
 #endif
 
 void* handle_client(void* args) {
-    int connfd = *((int *) args);
-    free(args);
-    char buffer[MAX];
-    int bytes_read;
-    bool packet_complete = false;
-    int data_fd = -1;
-    
-    while ((bytes_read = read(connfd, buffer, sizeof(buffer) - 1)) > 0) {
-        // Check for newline to determine packet completion
-        for (int i = 0; i < bytes_read; i++) {
-            if (buffer[i] == '\n') {
-                packet_complete = true;
-                break;
+    struct thread_node *node = args;
+    int connfd = node->connfd;
+
+    client_serve(connfd, node->binary);
+
+    // Under the list lock so a forced shutdown never hits a recycled descriptor
+    pthread_mutex_lock(&thread_list_mutex);
+    close(connfd);
+    node->connfd = -1;
+    pthread_mutex_unlock(&thread_list_mutex);
+    __atomic_store_n(&node->complete, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Join and free the threads of connections that have finished.
+ */
+static void reap_completed_threads(void) {
+    pthread_mutex_lock(&thread_list_mutex);
+    struct thread_node *node = SLIST_FIRST(&head);
+    struct thread_node *prev = NULL;
+
+    while (node != NULL) {
+        struct thread_node *next = SLIST_NEXT(node, entries);
+
+        if (__atomic_load_n(&node->complete, __ATOMIC_ACQUIRE)) {
+            // Remove from list
+            if (prev == NULL) {
+                SLIST_REMOVE_HEAD(&head, entries);
+            } else {
+                SLIST_NEXT(prev, entries) = SLIST_NEXT(node, entries);
             }
+            pthread_join(node->thread, NULL);
+            free(node);
+        } else {
+            prev = node;
         }
-        
-        // Open file descriptor on first access
-        pthread_mutex_lock(&mutex);
-        if (data_fd == -1) {
-            #if USE_AESD_CHAR_DEVICE
-                data_fd = open(data_file_path, O_RDWR);
-            #else
-                data_fd = open(data_file_path, O_RDWR | O_CREAT | O_APPEND, 0644);
-            #endif
-            
-            if (data_fd == -1) {
-                perror("open failed in handle_client");
-                pthread_mutex_unlock(&mutex);
-                break;
-            }
+
+        node = next;
+    }
+    pthread_mutex_unlock(&thread_list_mutex);
+}
+
+/**
+ * Create a dual-stack listening socket on the configured port.  Every listener sets
+ * SO_REUSEPORT so each acceptor gets its own accept queue and the kernel spreads incoming
+ * connections across them.  With @param cpu >= 0 and CPU steering enabled, SO_INCOMING_CPU
+ * asks the kernel to prefer this listener for connections arriving on that CPU.
+ * @return the listening socket, or -1 on failure
+ */
+static int create_listener(const struct listen_config *config, int cpu) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int opt = 1;
+    int off = 0;
+    int sockfd;
+
+    memset(&addr, 0, sizeof(addr));
+    sockfd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd >= 0) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+
+        // Accept IPv4 connections too, as IPv4-mapped addresses
+        setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_any;
+        addr6->sin6_port = htons(config->port);
+        addr_len = sizeof(*addr6);
+    } else {
+        struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+
+        // No IPv6 support in this kernel
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sockfd == -1) {
+            perror("socket creation failed");
+            return -1;
         }
-        
-        // Write to file
-        if (write(data_fd, buffer, bytes_read) < 0) {
-            perror("writing to file failed");
-            pthread_mutex_unlock(&mutex);
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+        addr4->sin_port = htons(config->port);
+        addr_len = sizeof(*addr4);
+    }
+
+    // Enable address reuse, and port sharing between acceptors
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt failed");
+        close(sockfd);
+        return -1;
+    }
+    if (config->steer_cpu && cpu >= 0 &&
+        setsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+        perror("SO_INCOMING_CPU failed");
+    }
+
+    if (bind(sockfd, (struct sockaddr *)&addr, addr_len) == -1) {
+        perror("bind failed");
+        close(sockfd);
+        return -1;
+    }
+
+    if (listen(sockfd, config->backlog) == -1) {
+        perror("listen failed");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * Start a thread for the accepted connection @param connfd, on @param cpu when CPU steering
+ * is enabled.
+ */
+static void start_client_thread(struct acceptor *acceptor, int connfd) {
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+
+    // Create new thread node
+    struct thread_node* new_node = malloc(sizeof(struct thread_node));
+    if (new_node == NULL) {
+        perror("Failed to allocate thread node");
+        close(connfd);
+        return;
+    }
+    new_node->complete = 0;
+    new_node->connfd = connfd;
+    new_node->binary = acceptor->config->binary;
+
+    pthread_attr_init(&attr);
+    if (acceptor->config->steer_cpu && acceptor->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(acceptor->cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    // Create thread to handle client; the list lock keeps the node from being reaped early
+    pthread_mutex_lock(&thread_list_mutex);
+    if (pthread_create(&new_node->thread, &attr, handle_client, new_node) != 0) {
+        pthread_mutex_unlock(&thread_list_mutex);
+        perror("Thread creation failed");
+        close(connfd);
+        free(new_node);
+    } else {
+        SLIST_INSERT_HEAD(&head, new_node, entries);
+        pthread_mutex_unlock(&thread_list_mutex);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static void fiber_client(void *args) {
+    struct fiber_client *client = args;
+
+    client_serve(client->connfd, client->binary);
+    close(client->connfd);
+    free(client);
+}
+
+/**
+ * Queue the accepted connection @param connfd on a fiber scheduler.
+ */
+static void start_client_fiber(struct acceptor *acceptor, int connfd) {
+    struct fiber_client *client = malloc(sizeof(*client));
+
+    if (client == NULL) {
+        perror("Failed to allocate fiber client");
+        close(connfd);
+        return;
+    }
+    client->connfd = connfd;
+    client->binary = acceptor->config->binary;
+    if (fiber_spawn(fiber_client, client) < 0) {
+        perror("Fiber creation failed");
+        close(connfd);
+        free(client);
+    }
+}
+
+static void* acceptor_thread(void* args) {
+    struct acceptor *acceptor = args;
+    struct sockaddr_storage client_address;
+    socklen_t client_len;
+    char host[INET6_ADDRSTRLEN];
+
+    while (!terminate_flag) {
+        struct pollfd pfds[2] = {
+            { .fd = acceptor->listen_fd, .events = POLLIN },
+            { .fd = shutdown_efd, .events = POLLIN },
+        };
+
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
             break;
         }
-        
-        // If a complete packet has been received, send the entire file back
-        if (packet_complete) {
-            #if USE_AESD_CHAR_DEVICE
-                // For character device, close and reopen to read from beginning
-                close(data_fd);
-                data_fd = open(data_file_path, O_RDONLY);
-                if (data_fd < 0) {
-                    perror("reopen for read failed");
-                    pthread_mutex_unlock(&mutex);
-                    break;
-                }
-            #else
-                // For regular file, seek to beginning
-                if (lseek(data_fd, 0, SEEK_SET) < 0) {
-                    perror("lseek failed");
-                    pthread_mutex_unlock(&mutex);
-                    break;
-                }
-            #endif
-            
-            // Read and send entire file
-            int read_bytes;
-            while ((read_bytes = read(data_fd, buffer, sizeof(buffer) - 1)) > 0) {
-                if (write(connfd, buffer, read_bytes) < 0) {
-                    perror("writing to socket failed");
-                    break;
-                }
+        if (terminate_flag || pfds[1].revents || (pfds[0].revents & (POLLERR | POLLNVAL))) {
+            break;
+        }
+
+        client_len = sizeof(client_address);
+        int connfd = accept4(acceptor->listen_fd, (struct sockaddr *)&client_address, &client_len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED && !terminate_flag) {
+                perror("accept failed");
             }
-            
-            #if USE_AESD_CHAR_DEVICE
-                // For character device, close and reopen for writing
-                close(data_fd);
-                data_fd = open(data_file_path, O_WRONLY);
-            #else
-                // Return to end of file for next writes
-                if (lseek(data_fd, 0, SEEK_END) < 0) {
-                    perror("lseek failed");
-                    pthread_mutex_unlock(&mutex);
-                    break;
-                }
-            #endif
-            
-            packet_complete = false;
+            continue;
         }
-        
-        pthread_mutex_unlock(&mutex);
+
+        if (client_address.ss_family == AF_INET6) {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&client_address)->sin6_addr, host, sizeof(host));
+        } else {
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&client_address)->sin_addr, host, sizeof(host));
+        }
+        syslog(LOG_INFO, "Accepted connection from %s", host);
+
+        if (use_fibers) {
+            start_client_fiber(acceptor, connfd);
+            continue;
+        }
+        start_client_thread(acceptor, connfd);
+
+        // Clean up completed threads
+        reap_completed_threads();
     }
-    
-    if (bytes_read < 0) {
-        perror("read failed");
+    return NULL;
+}
+
+/**
+ * Wait for client threads to finish, giving in-flight replies up to @param drain_ms
+ * milliseconds.  Connections still open after that are shut down so their threads fail out
+ * of any blocking send.
+ */
+static void drain_client_threads(long drain_ms) {
+    struct timespec deadline;
+    struct thread_node *node;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += drain_ms / 1000;
+    deadline.tv_nsec += (drain_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
     }
-    
-    if (data_fd >= 0) {
-        close(data_fd);
+
+    // No new nodes can appear: the acceptors have already been joined
+    SLIST_FOREACH(node, &head, entries) {
+        if (pthread_timedjoin_np(node->thread, NULL, &deadline) == 0) {
+            node->complete = 2;  // Already joined
+        }
+    }
+
+    pthread_mutex_lock(&thread_list_mutex);
+    SLIST_FOREACH(node, &head, entries) {
+        if (node->complete != 2 && node->connfd >= 0) {
+            shutdown(node->connfd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&thread_list_mutex);
+
+    while (!SLIST_EMPTY(&head)) {
+        node = SLIST_FIRST(&head);
+        SLIST_REMOVE_HEAD(&head, entries);
+        if (node->complete != 2) {
+            pthread_join(node->thread, NULL);
+        }
+        free(node);
     }
-    close(connfd);
-    return NULL;
+}
+
+/**
+ * Write the trace rings if SIGUSR1 asked for it.
+ */
+static void handle_trace_dump(void) {
+    if (!trace_dump_flag) return;
+    trace_dump_flag = false;
+    if (trace_dump(TRACE_DUMP_PATH) == 0) {
+        syslog(LOG_INFO, "Wrote trace to %s", TRACE_DUMP_PATH);
+    } else {
+        syslog(LOG_ERR, "Failed to write trace: %s", strerror(errno));
+    }
+}
+
+/**
+ * Accept and serve connections until SIGINT or SIGTERM, then drain them.  The calling thread
+ * has the shutdown signals blocked; @param wait_mask is the mask to wait for them with.
+ * @return 0 after a clean shutdown, -1 if serving could not start
+ */
+static int serve(const struct serve_config *config, const sigset_t *wait_mask) {
+    int i;
+
+    if (use_fibers &&
+        fiber_runtime_start(config->fiber_schedulers, shutdown_efd, config->pin_schedulers) < 0) {
+        return -1;
+    }
+    if (config->tail_log && fanout_start_tail() < 0) {
+        perror("Fan-out tail thread creation failed");
+        return -1;
+    }
+
+    for (i = 0; i < config->nacceptors; i++) {
+        struct acceptor *acceptor = &config->acceptors[i];
+        cpu_set_t cpus;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        if (acceptor->cpu >= 0) {
+            CPU_ZERO(&cpus);
+            CPU_SET(acceptor->cpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        if (pthread_create(&acceptor->thread, &attr, acceptor_thread, acceptor) != 0) {
+            perror("Acceptor thread creation failed");
+            return -1;
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    // Sleep until SIGINT or SIGTERM, dumping the trace rings on SIGUSR1
+    while (!terminate_flag) {
+        sigsuspend(wait_mask);
+        handle_trace_dump();
+    }
+
+    // Wake every thread waiting on the shutdown eventfd
+    uint64_t one = 1;
+    if (write(shutdown_efd, &one, sizeof(one)) < 0) {
+        perror("eventfd write failed");
+    }
+
+    // Stop accepting; the eventfd has already woken the acceptors
+    for (i = 0; i < config->nacceptors; i++) {
+        pthread_join(config->acceptors[i].thread, NULL);
+        close(config->acceptors[i].listen_fd);
+    }
+
+    // Idle clients have already been woken; give in-flight replies a bounded time to finish
+    if (use_fibers) {
+        fiber_runtime_stop(config->drain_ms);
+    } else {
+        drain_client_threads(config->drain_ms);
+    }
+    fanout_stop_tail();
+    return 0;
+}
+
+/**
+ * Start worker number @param index of a pre-forked server: fork, exec a fresh aesdsocket with
+ * the same arguments and pass it @param state, the listeners and the shared datastore, over a
+ * socketpair.  The worker serves until told to stop.  Exec'ing means a worker never inherits
+ * a lock held by another thread of this process (mappings, syslog, malloc), so crashed
+ * workers can be replaced while the supervisor's own threads run.
+ * @return the worker's pid, or -1 on failure
+ */
+static pid_t spawn_worker(const struct handover_state *state, int index) {
+    extern char **environ;
+    char exe[PATH_MAX];
+    char env_entry[sizeof(WORKER_ENV) + 24];
+    char **envp;
+    sigset_t no_signals;
+    size_t n = 0, i;
+    ssize_t len;
+    int sv[2];
+    pid_t pid;
+
+    // Everything the child needs is built before fork; it only makes async-signal-safe calls.
+    // Exec the binary by its real name so the worker's process name stays aesdsocket.
+    len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len < 0 || len == sizeof(exe) - 1) return -1;
+    exe[len] = '\0';
+    while (environ[n]) n++;
+    envp = malloc((n + 2) * sizeof(*envp));
+    if (!envp) return -1;
+    for (i = 0; i < n; i++) envp[i] = environ[i];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        free(envp);
+        return -1;
+    }
+    snprintf(env_entry, sizeof(env_entry), WORKER_ENV "=%d:%d", index, sv[1]);
+    envp[n] = env_entry;
+    envp[n + 1] = NULL;
+    // The mask survives exec; the worker blocks what it needs itself
+    sigemptyset(&no_signals);
+
+    pid = fork();
+    if (pid == 0) {
+        if (fcntl(sv[1], F_SETFD, 0) == 0 && sigprocmask(SIG_SETMASK, &no_signals, NULL) == 0) {
+            execve(exe, saved_argv, envp);
+        }
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    if (pid > 0 && handover_send(sv[0], state) < 0) {
+        syslog(LOG_ERR, "Failed to start worker %d", (int)pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        pid = -1;
+    }
+    close(sv[0]);
+    return pid;
+}
+
+/**
+ * Start @param nworkers workers given @param state into @param workers.
+ * @return the number of workers started
+ */
+static int start_workers(const struct handover_state *state, pid_t *workers, int nworkers) {
+    int running = 0;
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i] = spawn_worker(state, i);
+        if (workers[i] < 0) {
+            perror("fork failed");
+        } else {
+            running++;
+        }
+    }
+    return running;
+}
+
+/**
+ * Keep the @param running workers in @param workers going until SIGINT or SIGTERM,
+ * replacing any that crash with a new worker given @param state, then stop them all and wait
+ * for them to drain.
+ */
+static void supervise_workers(const struct serve_config *config, const struct handover_state *state,
+                              pid_t *workers, int nworkers, int running,
+                              const sigset_t *wait_mask) {
+    uint64_t one = 1;
+    int i;
+
+    while (!terminate_flag && running > 0) {
+        pid_t pid;
+        int status;
+
+        sigsuspend(wait_mask);
+        handle_trace_dump();
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < nworkers && workers[i] != pid; i++)
+                ;
+            if (i == nworkers) continue;
+            workers[i] = -1;
+            running--;
+            if (!WIFSIGNALED(status) || terminate_flag) {
+                // Exited on its own: a startup failure that restarting would only repeat
+                syslog(LOG_ERR, "Worker %d exited with status %d", (int)pid, WEXITSTATUS(status));
+                continue;
+            }
+            syslog(LOG_ERR, "Worker %d died from signal %d, restarting it", (int)pid,
+                   WTERMSIG(status));
+            workers[i] = spawn_worker(state, i);
+            if (workers[i] > 0) running++;
+        }
+    }
+
+    // Wake the supervisor's own timestamp thread, then stop the workers
+    if (write(shutdown_efd, &one, sizeof(one)) < 0) {
+        perror("eventfd write failed");
+    }
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i] > 0) kill(workers[i], SIGTERM);
+    }
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i] > 0) waitpid(workers[i], NULL, 0);
+    }
+    for (i = 0; i < config->nacceptors; i++) {
+        close(config->acceptors[i].listen_fd);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-D] [-s snapshot] [-p port] [-a acceptors] [-b backlog] [-c] "
+            "[-g drain_ms] [-B binary_port] [-f schedulers] [-z zerocopy_bytes] "
+            "[-T tier_dir [-M hot_bytes] [-S segment_bytes] [-R retain_bytes]] [-w workers] "
+            "[-o data_file] [-P replication_addr] [-F primary_addr] [-q subscriber_queue] "
+            "[-Q drop|disconnect] [-H handover_socket] [-L max_line_bytes]\n", prog);
 }
 
 int main(int argc, char **argv) {
-    int sockfd;
-    struct sockaddr_in server_address, client_address;
-    socklen_t client_len;
+    struct listen_config listen_config = {
+        .port = PORT,
+        .backlog = DEFAULT_BACKLOG,
+        .acceptors = 1,
+        .steer_cpu = false,
+    };
+    struct listen_config binary_config;
+    struct acceptor acceptors[MAX_ACCEPTORS + 1];  // One more for the binary port
+    int nacceptors;
+    int binary_port = 0;
     struct sigaction sa;
+    sigset_t block_mask, wait_mask;
     int daemon_mode = 0;
-    int c;
+    const char *snapshot_path = NULL;
+    struct tier_config tier_config = {
+        .hot_bytes = DEFAULT_HOT_BYTES,
+        .segment_bytes = DEFAULT_SEGMENT_BYTES,
+    };
+    long drain_ms = DEFAULT_DRAIN_MS;
+    int fiber_schedulers = 0;
+    int nworkers = 0;
+    int running = 0;
+    pid_t workers[MAX_WORKERS];
+    const char *publish_addr = NULL;
+    const char *follow_addr = NULL;
+    const char *handover_path = NULL;
+    struct handover_state handover = { .nlisteners = 0 };
+    const char *worker_env;
+    int worker_index = -1;  // Set in a worker exec'd by a pre-forked supervisor
+    bool adopted = false;
+    bool handed_over;
+    struct serve_config serve_config;
+    long ncpu;
+    int c, i;
     #if !USE_AESD_CHAR_DEVICE
         pthread_t timestamp_thread_id;
     #endif
     
     // Initialize the singly linked list
     SLIST_INIT(&head);
+    saved_argv = argv;
 
     // Set up signal handling
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = signal_handler;
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
 
-    // Check for daemon mode
-    while ((c = getopt(argc, argv, "d")) != -1) {
-        if (c == 'd') daemon_mode = 1;
+    while ((c = getopt(argc, argv, "dDs:p:a:b:cg:B:f:z:T:M:S:R:w:o:P:F:q:Q:H:L:")) != -1) {
+        switch (c) {
+        case 'd': daemon_mode = 1; break;
+        case 'D': client_config.delta_replies = true; break;
+        case 's': snapshot_path = optarg; break;
+        case 'p': listen_config.port = atoi(optarg); break;
+        case 'a': listen_config.acceptors = atoi(optarg); break;
+        case 'b': listen_config.backlog = atoi(optarg); break;
+        case 'c': listen_config.steer_cpu = true; break;
+        case 'g': drain_ms = atol(optarg); break;
+        case 'B': binary_port = atoi(optarg); break;
+        case 'f': use_fibers = true; fiber_schedulers = atoi(optarg); break;
+        case 'z': client_config.zerocopy_threshold = strtoul(optarg, NULL, 0); break;
+        case 'T': tier_config.dir = optarg; break;
+        case 'M': tier_config.hot_bytes = strtoul(optarg, NULL, 0); break;
+        case 'S': tier_config.segment_bytes = strtoul(optarg, NULL, 0); break;
+        case 'R': tier_config.retain_bytes = strtoull(optarg, NULL, 0); break;
+        case 'w': nworkers = atoi(optarg); break;
+        case 'o': data_file_path = optarg; break;
+        case 'P': publish_addr = optarg; break;
+        case 'F': follow_addr = optarg; client_config.read_only = true; break;
+        case 'H': handover_path = optarg; break;
+        case 'L': client_config.max_line_bytes = strtoul(optarg, NULL, 0); break;
+        case 'q': client_config.subscribe_queue = strtoul(optarg, NULL, 0); break;
+        case 'Q':
+            if (strcmp(optarg, "drop") != 0 && strcmp(optarg, "disconnect") != 0) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            client_config.subscribe_drop = strcmp(optarg, "drop") == 0;
+            break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
-
-    // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd == -1) {
-        perror("socket creation failed");
+    if (listen_config.acceptors < 1 || listen_config.acceptors > MAX_ACCEPTORS ||
+        listen_config.port <= 0 || listen_config.port > 65535 || listen_config.backlog < 1 ||
+        binary_port < 0 || binary_port > 65535 || binary_port == listen_config.port ||
+        fiber_schedulers < 0 || tier_config.hot_bytes == 0 || tier_config.segment_bytes == 0 ||
+        nworkers < 0 || nworkers > MAX_WORKERS || client_config.subscribe_queue == 0 ||
+        client_config.max_line_bytes == 0) {
+        usage(argv[0]);
         exit(EXIT_FAILURE);
     }
-
-    // Enable address reuse
-    int opt = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt failed");
-        close(sockfd);
+    if (tier_config.dir &&
+        (USE_AESD_CHAR_DEVICE || snapshot_path || nworkers || handover_path || publish_addr)) {
+        // The driver keeps the device history, snapshots cover the plain data file only, the
+        // hot ring is private to one process, and followers need history retention may delete
+        fprintf(stderr, "-T needs a file mode build and can't be combined with -s, -w, -H or -P\n");
+        exit(EXIT_FAILURE);
+    }
+    if (handover_path && publish_addr) {
+        // The replication listener can't be passed on, and both generations can't bind it
+        fprintf(stderr, "-H can't be combined with -P\n");
+        exit(EXIT_FAILURE);
+    }
+    if (USE_AESD_CHAR_DEVICE && client_config.delta_replies) {
+        // Delta replies track a byte offset, which shifts as the driver evicts entries
+        fprintf(stderr, "-D needs a file mode build\n");
+        exit(EXIT_FAILURE);
+    }
+    if (USE_AESD_CHAR_DEVICE && (publish_addr || follow_addr)) {
+        // Device offsets shift as the driver evicts entries, so they can't address a stream
+        fprintf(stderr, "-P and -F need a file mode build\n");
         exit(EXIT_FAILURE);
     }
 
-    // Set up server address
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_address.sin_port = htons(PORT);
+    // A worker exec'd by a pre-forked supervisor gets its listeners and datastore from it
+    worker_env = getenv(WORKER_ENV);
+    if (worker_env) {
+        int fd;
 
-    // Bind socket
-    if (bind(sockfd, (struct sockaddr *)&server_address, sizeof(server_address)) == -1) {
-        perror("bind failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        if (sscanf(worker_env, "%d:%d", &worker_index, &fd) != 2 ||
+            handover_receive_fd(fd, &handover) < 0) {
+            perror("receiving the worker state failed");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        unsetenv(WORKER_ENV);
+        adopted = true;
     }
 
-    // Listen for connections
-    if (listen(sockfd, 5) == -1) {
-        perror("listen failed");
-        close(sockfd);
+    // A running predecessor hands over its listeners and its live datastore
+    if (handover_path && worker_index < 0) {
+        int rc = handover_receive(handover_path, &handover);
+
+        if (rc < 0) {
+            perror("hot restart handover failed");
+            exit(EXIT_FAILURE);
+        }
+        adopted = rc == 1;
+    }
+
+    if (snapshot_path && !adopted) {
+        if (snapshot_restore(snapshot_path, data_file_path) == 0) {
+            syslog(LOG_INFO, "Restored history from %s", snapshot_path);
+        } else if (errno != ENOENT) {
+            syslog(LOG_ERR, "Failed to restore snapshot %s: %s", snapshot_path, strerror(errno));
+        }
+    }
+
+    // Open the shared data descriptors once, after any snapshot has been restored
+    if (adopted) {
+        if (datastore_adopt(handover.datastore_fds) < 0) {
+            perror("adopting the datastore failed");
+            exit(EXIT_FAILURE);
+        }
+        if (worker_index < 0) {
+            syslog(LOG_INFO, "Took over from the previous aesdsocket at %s", handover_path);
+        }
+    } else if (tier_config.dir) {
+        if (datastore_open_tiered(&tier_config) < 0) {
+            perror("open tiered store failed");
+            exit(EXIT_FAILURE);
+        }
+        syslog(LOG_INFO, "Tiered store %s holds offsets %lld to %lld", tier_config.dir,
+               (long long)datastore_base(), (long long)datastore_size());
+    } else if (datastore_open(data_file_path) < 0) {
+        perror("open data file failed");
         exit(EXIT_FAILURE);
     }
 
-    // Daemonize if requested
-    if (daemon_mode) {
+    // Bind every listener before daemonizing so port errors are reported to the caller
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nacceptors = listen_config.acceptors;
+    binary_config = listen_config;
+    binary_config.port = binary_port;
+    binary_config.binary = true;
+    if (binary_port) {
+        nacceptors++;
+    }
+    if (!adopted) {
+        handover.nlisteners = activation_listeners(handover.listeners, handover.binary);
+    }
+    if (handover.nlisteners > 0) {
+        // Sockets handed over or passed by the service manager are already bound
+        nacceptors = handover.nlisteners;
+        for (i = 0; i < nacceptors; i++) {
+            acceptors[i].config = handover.binary[i] ? &binary_config : &listen_config;
+            acceptors[i].cpu = ncpu > 0 ? i % ncpu : -1;
+            acceptors[i].listen_fd = handover.listeners[i];
+        }
+    }
+    for (i = 0; i < nacceptors && handover.nlisteners == 0; i++) {
+        acceptors[i].config = i < listen_config.acceptors ? &listen_config : &binary_config;
+        acceptors[i].cpu = ncpu > 0 ? i % ncpu : -1;
+        acceptors[i].listen_fd = create_listener(acceptors[i].config, acceptors[i].cpu);
+        if (acceptors[i].listen_fd < 0) {
+            while (i-- > 0) close(acceptors[i].listen_fd);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Daemonize if requested; a worker's supervisor already has
+    if (daemon_mode && worker_index < 0) {
         int pid = fork();
         if (pid < 0) {
             perror("fork failed");
-            close(sockfd);
             exit(EXIT_FAILURE);
         }
         else if (pid > 0) {
@@ -262,101 +904,124 @@ int main(int argc, char **argv) {
         close(STDERR_FILENO);
     }
 
-    #if !USE_AESD_CHAR_DEVICE
-        // Start timestamp thread only for regular file mode
-        if (pthread_create(&timestamp_thread_id, NULL, timestamp_thread, NULL) != 0) {
-            perror("Timestamp thread creation failed");
-            close(sockfd);
+    shutdown_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (shutdown_efd < 0) {
+        perror("eventfd creation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Workers, and a successor after a hot restart, must share the lock and the end of the
+    // log; an adopted datastore is shared already
+    if ((nworkers || handover_path) && !adopted && datastore_share() < 0) {
+        perror("sharing the datastore failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only the main thread handles SIGINT/SIGTERM/SIGUSR1; worker threads inherit the blocked mask
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    sigaddset(&block_mask, SIGUSR1);
+    if (nworkers && worker_index < 0) {
+        // The supervisor sleeps until a worker exits, too
+        sigaddset(&block_mask, SIGCHLD);
+        sigaction(SIGCHLD, &sa, NULL);
+    }
+    pthread_sigmask(SIG_BLOCK, &block_mask, &wait_mask);
+
+    // One scheduler per online CPU unless a count was given
+    if (use_fibers && fiber_schedulers == 0) {
+        fiber_schedulers = ncpu > 0 ? ncpu : 1;
+    }
+    serve_config.acceptors = acceptors;
+    serve_config.nacceptors = nacceptors;
+    serve_config.fiber_schedulers = fiber_schedulers;
+    serve_config.pin_schedulers = listen_config.steer_cpu;
+    serve_config.drain_ms = drain_ms;
+    // A shared log also grows through other processes, whose appends subscribers here must see
+    serve_config.tail_log = !USE_AESD_CHAR_DEVICE && (adopted || nworkers || handover_path);
+    client_config.no_subscribe = USE_AESD_CHAR_DEVICE && (adopted || nworkers || handover_path);
+
+    if (worker_index >= 0) {
+        // Spread the workers' acceptor threads over the CPUs instead of stacking them up
+        for (i = 0; i < nacceptors; i++) {
+            if (acceptors[i].cpu >= 0 && ncpu > 0) {
+                acceptors[i].cpu = (acceptors[i].cpu + worker_index * nacceptors) % ncpu;
+            }
+        }
+        if (serve(&serve_config, &wait_mask) < 0) {
             exit(EXIT_FAILURE);
         }
-    #endif
+        datastore_close();
+        exit(EXIT_SUCCESS);
+    }
 
-    // Main server loop
-    while (!terminate_flag) {
-        client_len = sizeof(client_address);
-        int* connfd = (int*) malloc(sizeof(int));
-        *connfd = accept(sockfd, (struct sockaddr *)&client_address, &client_len);
-        
-        if (*connfd < 0) {
-            free(connfd);
-            if (terminate_flag) break;
-            perror("accept failed");
-            continue;
+    // What workers and a successor after a hot restart take over
+    if (nworkers || handover_path) {
+        datastore_export(handover.datastore_fds);
+        handover.nlisteners = nacceptors;
+        for (i = 0; i < nacceptors; i++) {
+            handover.listeners[i] = acceptors[i].listen_fd;
+            handover.binary[i] = acceptors[i].config->binary;
         }
+    }
+    if (nworkers) {
+        running = start_workers(&handover, workers, nworkers);
+    }
 
-        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(client_address.sin_addr));
-        
-        // Create new thread node
-        struct thread_node* new_node = malloc(sizeof(struct thread_node));
-        if (new_node == NULL) {
-            perror("Failed to allocate thread node");
-            free(connfd);
-            continue;
-        }
-        
-        new_node->complete = 0;
-        
-        // Create thread to handle client
-        if (pthread_create(&new_node->thread, NULL, handle_client, (void *)connfd) != 0) {
-            perror("Thread creation failed");
-            free(connfd);
-            free(new_node);
-            continue;
-        }
-        
-        // Add thread to list
-        pthread_mutex_lock(&mutex);
-        SLIST_INSERT_HEAD(&head, new_node, entries);
-        pthread_mutex_unlock(&mutex);
-        
-        // Clean up completed threads
-        pthread_mutex_lock(&mutex);
-        struct thread_node *node = SLIST_FIRST(&head);
-        struct thread_node *prev = NULL;
-        
-        while (node != NULL) {
-            struct thread_node *next = SLIST_NEXT(node, entries);
-            
-            if (node->complete) {
-                // Remove from list
-                if (prev == NULL) {
-                    SLIST_REMOVE_HEAD(&head, entries);
-                } else {
-                    SLIST_NEXT(prev, entries) = SLIST_NEXT(node, entries);
-                }
-                pthread_join(node->thread, NULL);
-                free(node);
-            } else {
-                prev = node;
-            }
-            
-            node = next;
+    // Listen for a successor once everything it needs exists
+    if (handover_path) {
+        if (handover_start(handover_path, &handover) < 0) {
+            perror("hot restart socket failed");
+            exit(EXIT_FAILURE);
         }
-        pthread_mutex_unlock(&mutex);
     }
 
-    // Cleanup when exiting
-    close(sockfd);
+    // Replication runs once, here rather than in each worker
+    if ((publish_addr && replication_start_primary(publish_addr) < 0) ||
+        (follow_addr && replication_start_follower(follow_addr) < 0)) {
+        exit(EXIT_FAILURE);
+    }
+
+    #if !USE_AESD_CHAR_DEVICE
+        // Start timestamp thread only for regular file mode; with workers it runs here once.
+        // A follower gets its timestamps from the primary.
+        if (!follow_addr &&
+            pthread_create(&timestamp_thread_id, NULL, timestamp_thread, NULL) != 0) {
+            perror("Timestamp thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+
+    if (nworkers) {
+        supervise_workers(&serve_config, &handover, workers, nworkers, running, &wait_mask);
+    } else if (serve(&serve_config, &wait_mask) < 0) {
+        exit(EXIT_FAILURE);
+    }
 
     #if !USE_AESD_CHAR_DEVICE
         // Join timestamp thread
-        pthread_join(timestamp_thread_id, NULL);
+        if (!follow_addr) pthread_join(timestamp_thread_id, NULL);
     #endif
+    replication_stop();
+    handed_over = handover_stop();
 
-    // Join all client threads
-    struct thread_node *node;
-    while (!SLIST_EMPTY(&head)) {
-        node = SLIST_FIRST(&head);
-        SLIST_REMOVE_HEAD(&head, entries);
-        pthread_join(node->thread, NULL);
-        free(node);
+    datastore_close();
+
+    // After a handover the successor owns the history; leave it alone
+    if (snapshot_path && !handed_over && snapshot_save(snapshot_path, data_file_path) < 0) {
+        syslog(LOG_ERR, "Failed to save snapshot %s: %s", snapshot_path, strerror(errno));
     }
 
     #if !USE_AESD_CHAR_DEVICE
-        // Only remove regular file, not character device
-        unlink(data_file_path);
+        // Only remove regular file, not character device; a tiered store persists, a follower
+        // keeps its copy so a restart resumes from where it left off, and a primary keeps the
+        // history its followers already hold
+        if (!tier_config.dir && !follow_addr && !publish_addr && !handed_over) {
+            unlink(data_file_path);
+        }
     #endif
     
     syslog(LOG_INFO, "Caught signal, exiting");
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,21 @@
+/**
+ * @file aesdsocket.h
+ * @brief Build configuration shared by the aesdsocket translation units
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 1  // Default to 1
+#endif
+
+#include <signal.h>
+
+// Set by the SIGINT/SIGTERM handler
+extern volatile sig_atomic_t terminate_flag;
+
+// Becomes readable once the server starts shutting down; threads poll it alongside their work
+extern int shutdown_efd;
+
+#endif /* AESDSOCKET_H */
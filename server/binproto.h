@@ -0,0 +1,56 @@
+/**
+ * @file binproto.h
+ * @brief Length prefixed binary framing for aesdsocket
+ *
+ * A connection switches to binary framing by sending BINPROTO_MAGIC as its first four bytes,
+ * or by connecting to the binary port (-B).  Every request and response is then a
+ * struct binproto_header followed by length payload bytes.  Multi byte integers are big endian.
+ *
+ * Requests and their payloads:
+ *   BINPROTO_APPEND      data to store, which may contain any bytes including '\n'
+ *   BINPROTO_READ_RANGE  u64 offset, u64 length
+ *   BINPROTO_READ_SINCE  u64 offset; reads to the current end of the data
+ *   BINPROTO_STATS       empty
+ *
+ * Responses carry the request type with BINPROTO_RESPONSE set:
+ *   APPEND      u64 end offset of the data after the append (all ones in char device mode)
+ *   READ_*      the requested bytes, possibly fewer at the end of the data
+ *   STATS       struct binproto_stats
+ * A request that fails is answered with BINPROTO_ERROR carrying a u32 errno value.
+ * A read only follower (-F) answers APPEND with EROFS.
+ */
+
+#ifndef AESDSOCKET_BINPROTO_H
+#define AESDSOCKET_BINPROTO_H
+
+#include <stdint.h>
+
+#define BINPROTO_MAGIC "\0AB1"
+#define BINPROTO_MAGIC_LEN 4
+
+// Largest request payload accepted; larger frames are answered with EMSGSIZE and the connection closed
+#define BINPROTO_MAX_PAYLOAD (16 * 1024 * 1024)
+
+enum binproto_type {
+    BINPROTO_APPEND = 1,
+    BINPROTO_READ_RANGE = 2,
+    BINPROTO_READ_SINCE = 3,
+    BINPROTO_STATS = 4,
+    BINPROTO_RESPONSE = 0x80,
+    BINPROTO_ERROR = 0xff,
+};
+
+struct binproto_header {
+    uint8_t type;
+    uint8_t flags;        // Reserved, zero
+    uint16_t reserved;    // Reserved, zero
+    uint32_t length;      // Payload bytes following the header
+} __attribute__((packed));
+
+struct binproto_stats {
+    uint64_t data_size;       // Bytes stored, all ones in char device mode
+    uint64_t appends;         // Packets and frames appended since startup
+    uint64_t bytes_appended;  // Bytes appended since startup
+} __attribute__((packed));
+
+#endif /* AESDSOCKET_BINPROTO_H */
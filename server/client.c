@@ -0,0 +1,841 @@
+/**
+ * @file client.c
+ * @brief Per connection protocol handling for aesdsocket
+ *
+ * Every newline terminated packet is a separate request: it is stored, and a reply describing
+ * the data to send back is queued on the connection.  The connection loop keeps reading while
+ * queued replies drain, so a client can pipeline packets without waiting a round trip for
+ * each one.  Replies are sent with MSG_MORE while more reply data is queued so the kernel
+ * coalesces them into full segments.
+ *
+ * In file mode, replies of at least client_config.zerocopy_threshold bytes are sent with
+ * MSG_ZEROCOPY straight from a shared mapping of the data file.  The connection keeps a
+ * reference on every mapping a send may still be reading until the socket's error queue
+ * reports that send complete.  If the kernel reports it had to copy anyway (loopback, for
+ * one), the connection goes back to the copy path, which is cheaper in that case.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "aesdsocket.h"
+#include "client.h"
+#include "datastore.h"
+#include "binproto.h"
+#include "trace.h"
+#include "fiber.h"
+#include "fanout.h"
+
+#define READ_CHUNK 4096
+#define REPLY_CHUNK 16384
+#define LINE_INITIAL_SIZE 80
+// Stop reading from a client that lets this many replies pile up
+#define MAX_QUEUED_REPLIES 64
+// Largest single MSG_ZEROCOPY send, and mappings a connection may wait on at once
+#define ZEROCOPY_CHUNK (256 * 1024)
+#define ZEROCOPY_MAX_HOLDS 8
+
+/*
+ * Control lines start with this prefix; they select a reply mode for the connection and are
+ * neither stored nor answered.
+ *   AESDSOCKET_MODE:full   reply with the whole history after every packet (default)
+ *   AESDSOCKET_MODE:delta  reply only with data this connection has not been sent yet (file
+ *                          mode only: device offsets shift as the driver evicts entries)
+ *   AESDSOCKET_MODE:subscribe  also push every packet stored from now on, by any client, as
+ *                              it is stored
+ */
+#define CONTROL_PREFIX "AESDSOCKET_MODE:"
+
+struct client_config client_config = {
+    .delta_replies = false,
+    .zerocopy_threshold = 64 * 1024,
+    .subscribe_queue = 1024,
+    .subscribe_drop = false,
+    .max_line_bytes = BINPROTO_MAX_PAYLOAD,
+};
+
+/**
+ * Data queued to be sent to a client: either a byte range of the data file, read lazily as
+ * the socket drains (file mode), or a buffer captured when the packet was stored (char device
+ * mode, where offsets are not stable across evictions).
+ */
+struct reply {
+    STAILQ_ENTRY(reply) entries;
+    off_t offset;         // Next byte of the range to read
+    off_t end;            // End of the range
+    char *data;           // Owned buffer, or NULL for a range reply
+    struct fanout_msg *msg;  // Pushed message data points into, shared with other subscribers
+    size_t data_len;
+    size_t data_sent;
+};
+STAILQ_HEAD(reply_queue, reply);
+
+enum framing {
+    FRAMING_UNKNOWN,      // Waiting for the first bytes to tell text from binary
+    FRAMING_TEXT,
+    FRAMING_BINARY,
+};
+
+struct connection {
+    int connfd;
+    enum framing framing;
+    char *line;           // Bytes received since the last newline, or a partial binary frame
+    size_t line_len;
+    size_t line_cap;
+    bool delta;           // Reply only with data past sent_offset
+    off_t sent_offset;    // End of the data last queued for this client
+    struct reply_queue replies;
+    size_t queued;        // Number of entries in replies
+    struct subscriber *sub;  // Set once the client subscribes
+    char stage[REPLY_CHUNK];  // Range data read but not yet accepted by the socket
+    size_t stage_len;
+    size_t stage_pos;
+#if !USE_AESD_CHAR_DEVICE
+    int zerocopy;             // 1 once SO_ZEROCOPY is on, -1 when not to be used
+    uint32_t zc_next;         // Id the kernel gives the next MSG_ZEROCOPY send
+    uint32_t zc_done;         // Sends with lower ids have completed
+    struct datastore_map *zc_map;  // Mapping new sends are made from
+    struct {
+        struct datastore_map *map;
+        uint32_t last_id;     // Sends with lower ids may still read from map
+    } zc_holds[ZEROCOPY_MAX_HOLDS];
+    int zc_nholds;
+#endif
+};
+
+/**
+ * @return true if the packet in @param line was a control line and has been consumed
+ */
+static bool handle_control_line(struct connection *conn, const char *line, size_t len) {
+    size_t prefix_len = sizeof(CONTROL_PREFIX) - 1;
+
+    if (len < prefix_len || memcmp(line, CONTROL_PREFIX, prefix_len) != 0) {
+        return false;
+    }
+    line += prefix_len;
+    len -= prefix_len;
+    if (len >= 6 && memcmp(line, "delta\n", 6) == 0) {
+#if USE_AESD_CHAR_DEVICE
+        syslog(LOG_WARNING, "Delta replies need file mode; keeping full replies");
+#else
+        conn->delta = true;
+#endif
+    } else if (len >= 5 && memcmp(line, "full\n", 5) == 0) {
+        conn->delta = false;
+    } else if (len >= 10 && memcmp(line, "subscribe\n", 10) == 0) {
+        if (client_config.no_subscribe) {
+            syslog(LOG_WARNING, "Subscriptions need file mode with -w or -H; not subscribing");
+        } else if (!conn->sub) {
+            conn->sub = fanout_subscribe(client_config.subscribe_queue, client_config.subscribe_drop);
+            if (!conn->sub) perror("subscribe failed");
+        }
+    } else {
+        syslog(LOG_WARNING, "Ignoring unknown control line");
+    }
+    return true;
+}
+
+static void enqueue_reply(struct connection *conn, struct reply *reply) {
+    STAILQ_INSERT_TAIL(&conn->replies, reply, entries);
+    conn->queued++;
+}
+
+static void free_reply(struct connection *conn, struct reply *reply) {
+    STAILQ_REMOVE_HEAD(&conn->replies, entries);
+    conn->queued--;
+    if (reply->msg) {
+        fanout_put(reply->msg);
+    } else {
+        free(reply->data);
+    }
+    free(reply);
+}
+
+#if USE_AESD_CHAR_DEVICE
+/**
+ * Copy the device contents from @param offset into @param reply.  Caller holds the datastore
+ * lock.
+ */
+static int capture_reply(struct reply *reply, off_t offset) {
+    size_t cap = REPLY_CHUNK;
+    ssize_t n;
+
+    reply->data = malloc(cap);
+    if (!reply->data) return -1;
+    while ((n = datastore_pread(reply->data + reply->data_len, cap - reply->data_len,
+                                offset + reply->data_len)) > 0) {
+        reply->data_len += n;
+        if (reply->data_len == cap) {
+            char *grown = realloc(reply->data, cap * 2);
+            if (!grown) return -1;
+            reply->data = grown;
+            cap *= 2;
+        }
+    }
+    return n < 0 ? -1 : 0;
+}
+#endif
+
+/**
+ * Store one newline terminated packet and queue the reply for it.  A read only follower
+ * only queues the reply.
+ */
+static int handle_packet(struct connection *conn, const char *packet, size_t len) {
+    struct reply *reply;
+    int rc;
+
+    if (handle_control_line(conn, packet, len)) {
+        return 0;
+    }
+
+    reply = calloc(1, sizeof(*reply));
+    if (!reply) {
+        perror("malloc failed");
+        return -1;
+    }
+
+    datastore_lock();
+    rc = client_config.read_only ? 0 : datastore_append(packet, len);
+    if (rc < 0) {
+        perror("writing to file failed");
+    } else {
+#if USE_AESD_CHAR_DEVICE
+        rc = capture_reply(reply, 0);
+        if (rc < 0) {
+            perror("reading data file failed");
+        }
+#else
+        reply->offset = conn->delta ? conn->sent_offset : 0;
+        // The reply covers the data up to and including this packet, even if others append later
+        reply->end = datastore_size();
+        if (reply->offset < datastore_base()) reply->offset = datastore_base();
+        conn->sent_offset = reply->end;
+#endif
+    }
+    datastore_unlock();
+
+    if (rc < 0) {
+        free(reply->data);
+        free(reply);
+        return -1;
+    }
+    enqueue_reply(conn, reply);
+    return 0;
+}
+
+#if !USE_AESD_CHAR_DEVICE
+/**
+ * Read completion notifications from the socket error queue and drop the mapping references
+ * no longer needed by any in-flight send.
+ * @return the number of notifications read, or -1 on error
+ */
+static int reap_zerocopy(struct connection *conn) {
+    int count = 0;
+    int i, kept;
+
+    for (;;) {
+        char control[128];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg;
+
+        if (recvmsg(conn->connfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EINTR) break;
+            return -1;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err *serr;
+
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            // ee_info..ee_data is the range of completed send ids
+            if ((int32_t)(serr->ee_data + 1 - conn->zc_done) > 0) {
+                conn->zc_done = serr->ee_data + 1;
+            }
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                conn->zerocopy = -1;
+            }
+            count++;
+        }
+    }
+
+    for (i = 0, kept = 0; i < conn->zc_nholds; i++) {
+        if ((int32_t)(conn->zc_done - conn->zc_holds[i].last_id) >= 0) {
+            datastore_map_put(conn->zc_holds[i].map);
+        } else {
+            conn->zc_holds[kept++] = conn->zc_holds[i];
+        }
+    }
+    conn->zc_nholds = kept;
+    return count;
+}
+
+/**
+ * Send the start of range @param reply with MSG_ZEROCOPY from the data file mapping.
+ * @return bytes sent, 0 if the copy path should send this chunk, -1 on error with errno set
+ */
+static ssize_t send_zerocopy(struct connection *conn, struct reply *reply, bool more) {
+    size_t len = reply->end - reply->offset;
+    ssize_t n;
+
+    if (conn->zerocopy == 0) {
+        int one = 1;
+
+        conn->zerocopy = setsockopt(conn->connfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0
+                         ? 1 : -1;
+        if (conn->zerocopy < 0) return 0;
+    }
+    if (!conn->zc_map || conn->zc_map->len < (size_t)reply->end) {
+        struct datastore_map *map;
+
+        // Earlier sends may still read the old mapping; keep it until they complete
+        if (conn->zc_map && conn->zc_nholds == ZEROCOPY_MAX_HOLDS) return 0;
+        map = datastore_map_get(reply->end);
+        if (!map) {
+            if (errno == ENOTSUP) conn->zerocopy = -1;
+            return 0;
+        }
+        if (conn->zc_map) {
+            conn->zc_holds[conn->zc_nholds].map = conn->zc_map;
+            conn->zc_holds[conn->zc_nholds].last_id = conn->zc_next;
+            conn->zc_nholds++;
+        }
+        conn->zc_map = map;
+    }
+
+    if (len > ZEROCOPY_CHUNK) len = ZEROCOPY_CHUNK;
+    if (reply->offset + (off_t)len < reply->end) more = true;
+    n = send(conn->connfd, conn->zc_map->base + reply->offset, len,
+             MSG_ZEROCOPY | MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0));
+    if (n < 0) {
+        // ENOBUFS: out of socket option memory for pinning pages; copy this chunk instead
+        return errno == ENOBUFS ? 0 : -1;
+    }
+    conn->zc_next++;
+    reply->offset += n;
+    return n;
+}
+
+static void release_zerocopy(struct connection *conn) {
+    int i;
+
+    // In-flight sends hold their own page references, so the mappings can go now
+    for (i = 0; i < conn->zc_nholds; i++) {
+        datastore_map_put(conn->zc_holds[i].map);
+    }
+    conn->zc_nholds = 0;
+    if (conn->zc_map) datastore_map_put(conn->zc_map);
+    conn->zc_map = NULL;
+}
+#endif
+
+/**
+ * Send as much queued reply data as the socket accepts without blocking.
+ * @return 0 when the queue is empty or the socket is full, -1 on error
+ */
+static int flush_queue(struct connection *conn) {
+    struct reply *reply;
+
+    while ((reply = STAILQ_FIRST(&conn->replies)) != NULL) {
+        const char *chunk;
+        size_t chunk_len;
+        bool more;
+        ssize_t n;
+
+        if (reply->data) {
+            chunk = reply->data + reply->data_sent;
+            chunk_len = reply->data_len - reply->data_sent;
+            more = STAILQ_NEXT(reply, entries) != NULL;
+        } else {
+#if !USE_AESD_CHAR_DEVICE
+            if (conn->stage_pos == conn->stage_len && conn->zerocopy >= 0 &&
+                client_config.zerocopy_threshold &&
+                reply->end - reply->offset >= (off_t)client_config.zerocopy_threshold) {
+                n = send_zerocopy(conn, reply, STAILQ_NEXT(reply, entries) != NULL);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN) return 0;
+                    perror("writing to socket failed");
+                    return -1;
+                }
+                if (n > 0) {
+                    if (reply->offset >= reply->end) free_reply(conn, reply);
+                    continue;
+                }
+            }
+#endif
+            if (conn->stage_pos == conn->stage_len) {
+                size_t want = sizeof(conn->stage);
+
+                if ((off_t)want > reply->end - reply->offset) want = reply->end - reply->offset;
+                n = want ? datastore_pread(conn->stage, want, reply->offset) : 0;
+                if (n < 0 && errno == ENODATA && conn->framing != FRAMING_BINARY) {
+                    // Retention deleted the rest of this range while it was queued; skip it.
+                    // A binary frame's length is already sent, so there the connection fails.
+                    reply->offset = datastore_base();
+                    if (reply->offset > reply->end) reply->offset = reply->end;
+                    continue;
+                }
+                if (n < 0) {
+                    perror("reading data file failed");
+                    return -1;
+                }
+                if (n == 0) {
+                    free_reply(conn, reply);
+                    continue;
+                }
+                conn->stage_len = n;
+                conn->stage_pos = 0;
+                reply->offset += n;
+            }
+            chunk = conn->stage + conn->stage_pos;
+            chunk_len = conn->stage_len - conn->stage_pos;
+            more = reply->offset < reply->end || STAILQ_NEXT(reply, entries) != NULL;
+        }
+
+        if (chunk_len == 0) {
+            free_reply(conn, reply);
+            continue;
+        }
+        n = send(conn->connfd, chunk, chunk_len, MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            perror("writing to socket failed");
+            return -1;
+        }
+
+        if (reply->data) {
+            reply->data_sent += n;
+            if (reply->data_sent == reply->data_len) free_reply(conn, reply);
+        } else {
+            conn->stage_pos += n;
+            if (conn->stage_pos == conn->stage_len && reply->offset >= reply->end) {
+                free_reply(conn, reply);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Flush the reply queue, traced as one reply_stream stage.
+ */
+static int flush_replies(struct connection *conn) {
+    int rc;
+
+    TRACE_BEGIN(reply_stream, conn->queued);
+    rc = flush_queue(conn);
+    TRACE_END(reply_stream, conn->queued);
+    return rc;
+}
+
+/**
+ * Move messages published to a subscribed connection onto its reply queue, as long as the
+ * queue has room; the rest wait in the subscriber's own bounded queue.
+ */
+static int queue_pushed(struct connection *conn) {
+    while (conn->queued < MAX_QUEUED_REPLIES) {
+        struct fanout_msg *msg = fanout_next(conn->sub);
+        struct reply *reply;
+
+        if (!msg) return 0;
+        reply = calloc(1, sizeof(*reply));
+        if (!reply) {
+            fanout_put(msg);
+            return -1;
+        }
+        reply->msg = msg;
+        reply->data = msg->data;
+        reply->data_len = msg->len;
+        enqueue_reply(conn, reply);
+    }
+    return 0;
+}
+
+/**
+ * Append @param len received bytes to the pending line.
+ */
+static int buffer_line(struct connection *conn, const char *data, size_t len) {
+    if (conn->line_len + len > conn->line_cap) {
+        size_t cap = conn->line_cap ? conn->line_cap : LINE_INITIAL_SIZE;
+        char *grown;
+
+        while (cap < conn->line_len + len) cap *= 2;
+        grown = realloc(conn->line, cap);
+        if (!grown) {
+            perror("realloc failed");
+            return -1;
+        }
+        conn->line = grown;
+        conn->line_cap = cap;
+    }
+    memcpy(conn->line + conn->line_len, data, len);
+    conn->line_len += len;
+    return 0;
+}
+
+/**
+ * Append @param len bytes of a text packet to the pending line, refusing packets longer than
+ * max_line_bytes so a client that never sends a newline can't exhaust memory.
+ */
+static int buffer_text(struct connection *conn, const char *data, size_t len) {
+    if (conn->line_len + len > client_config.max_line_bytes) {
+        syslog(LOG_WARNING, "Closing a connection whose packet exceeds %zu bytes",
+               client_config.max_line_bytes);
+        // Not stored either
+        conn->line_len = 0;
+        return -1;
+    }
+    return buffer_line(conn, data, len);
+}
+
+/**
+ * Queue a binary response made of a header and @param len bytes copied from @param payload.
+ */
+static int queue_frame(struct connection *conn, uint8_t type, const void *payload, size_t len) {
+    struct binproto_header header = {
+        .type = type,
+        .length = htobe32(len),
+    };
+    struct reply *reply = calloc(1, sizeof(*reply));
+
+    if (!reply) return -1;
+    reply->data = malloc(sizeof(header) + len);
+    if (!reply->data) {
+        free(reply);
+        return -1;
+    }
+    memcpy(reply->data, &header, sizeof(header));
+    if (len) memcpy(reply->data + sizeof(header), payload, len);
+    reply->data_len = sizeof(header) + len;
+    enqueue_reply(conn, reply);
+    return 0;
+}
+
+static int queue_error(struct connection *conn, int err) {
+    uint32_t code = htobe32(err);
+
+    return queue_frame(conn, BINPROTO_ERROR, &code, sizeof(code));
+}
+
+/**
+ * Queue a data response for @param length bytes at @param offset.  In file mode the header
+ * is followed by a lazily read range reply; in char device mode the bytes are read now.
+ */
+static int queue_read(struct connection *conn, uint8_t type, uint64_t offset, uint64_t length) {
+#if USE_AESD_CHAR_DEVICE
+    struct reply *reply = calloc(1, sizeof(*reply));
+    int rc;
+
+    if (!reply) return -1;
+    datastore_lock();
+    rc = capture_reply(reply, offset);
+    datastore_unlock();
+    if (rc < 0) {
+        free(reply->data);
+        free(reply);
+        return queue_error(conn, EIO);
+    }
+    if (reply->data_len > length) reply->data_len = length;
+    rc = queue_frame(conn, type | BINPROTO_RESPONSE, reply->data, reply->data_len);
+    free(reply->data);
+    free(reply);
+    return rc;
+#else
+    struct binproto_header header = { .type = type | BINPROTO_RESPONSE };
+    struct reply *reply;
+    off_t size = datastore_size();
+    uint64_t end;
+
+    if (offset > (uint64_t)size) offset = size;
+    if (offset < (uint64_t)datastore_base()) offset = datastore_base();
+    end = length > (uint64_t)size - offset ? (uint64_t)size : offset + length;
+    header.length = htobe32(end - offset);
+
+    reply = calloc(1, sizeof(*reply));
+    if (!reply || !(reply->data = malloc(sizeof(header)))) {
+        free(reply);
+        return -1;
+    }
+    memcpy(reply->data, &header, sizeof(header));
+    reply->data_len = sizeof(header);
+    enqueue_reply(conn, reply);
+
+    reply = calloc(1, sizeof(*reply));
+    if (!reply) return -1;
+    reply->offset = offset;
+    reply->end = end;
+    enqueue_reply(conn, reply);
+    return 0;
+#endif
+}
+
+/**
+ * Handle one complete binary request.
+ */
+static int handle_frame(struct connection *conn, const struct binproto_header *header,
+                        const char *payload, uint32_t len) {
+    uint64_t args[2];
+
+    switch (header->type) {
+    case BINPROTO_APPEND: {
+        uint64_t end;
+        int rc;
+
+        if (client_config.read_only) return queue_error(conn, EROFS);
+        datastore_lock();
+        rc = datastore_append(payload, len);
+        end = datastore_size();
+        datastore_unlock();
+        if (rc < 0) return queue_error(conn, errno);
+        end = htobe64(end);
+        return queue_frame(conn, BINPROTO_APPEND | BINPROTO_RESPONSE, &end, sizeof(end));
+    }
+    case BINPROTO_READ_RANGE:
+        if (len != 2 * sizeof(uint64_t)) return queue_error(conn, EINVAL);
+        memcpy(args, payload, sizeof(args));
+        // A read reply is bounded by the frame's 32 bit length field
+        if (be64toh(args[1]) > UINT32_MAX) args[1] = htobe64(UINT32_MAX);
+        return queue_read(conn, header->type, be64toh(args[0]), be64toh(args[1]));
+    case BINPROTO_READ_SINCE:
+        if (len != sizeof(uint64_t)) return queue_error(conn, EINVAL);
+        memcpy(args, payload, sizeof(uint64_t));
+        return queue_read(conn, header->type, be64toh(args[0]), UINT32_MAX);
+    case BINPROTO_STATS: {
+        struct datastore_stats stats;
+        struct binproto_stats out;
+
+        datastore_get_stats(&stats);
+        out.data_size = htobe64(datastore_size());
+        out.appends = htobe64(stats.appends);
+        out.bytes_appended = htobe64(stats.bytes_appended);
+        return queue_frame(conn, BINPROTO_STATS | BINPROTO_RESPONSE, &out, sizeof(out));
+    }
+    default:
+        return queue_error(conn, EOPNOTSUPP);
+    }
+}
+
+/**
+ * Accumulate binary input and handle every complete frame in it.
+ */
+static int handle_binary_input(struct connection *conn, const char *buffer, size_t len) {
+    size_t pos = 0;
+
+    if (len && buffer_line(conn, buffer, len) < 0) return -1;
+    while (conn->line_len - pos >= sizeof(struct binproto_header)) {
+        struct binproto_header header;
+        uint32_t payload_len;
+
+        memcpy(&header, conn->line + pos, sizeof(header));
+        payload_len = be32toh(header.length);
+        if (payload_len > BINPROTO_MAX_PAYLOAD) {
+            // The stream can't be resynchronized; report and stop reading
+            queue_error(conn, EMSGSIZE);
+            return 1;
+        }
+        if (conn->line_len - pos - sizeof(header) < payload_len) break;
+        if (handle_frame(conn, &header, conn->line + pos + sizeof(header), payload_len) < 0) {
+            return -1;
+        }
+        pos += sizeof(header) + payload_len;
+    }
+    memmove(conn->line, conn->line + pos, conn->line_len - pos);
+    conn->line_len -= pos;
+    return 0;
+}
+
+/**
+ * Split @param len received bytes into packets; every newline completes one.
+ */
+static int handle_text_input(struct connection *conn, const char *buffer, size_t len) {
+    const char *start = buffer;
+    const char *end = buffer + len;
+    const char *newline;
+
+    while ((newline = memchr(start, '\n', end - start)) != NULL) {
+        size_t packet_len = newline - start + 1;
+        int rc;
+
+        if (conn->line_len) {
+            if (buffer_text(conn, start, packet_len) < 0) return -1;
+            rc = handle_packet(conn, conn->line, conn->line_len);
+            conn->line_len = 0;
+        } else if (packet_len > client_config.max_line_bytes) {
+            rc = buffer_text(conn, start, packet_len);
+        } else {
+            rc = handle_packet(conn, start, packet_len);
+        }
+        if (rc < 0) return -1;
+        start = newline + 1;
+    }
+    if (start < end && buffer_text(conn, start, end - start) < 0) return -1;
+    return 0;
+}
+
+/**
+ * Dispatch received bytes to the connection's framing, deciding it from the first bytes.
+ * @return 0 to keep reading, 1 to stop reading, -1 on error
+ */
+static int handle_input(struct connection *conn, const char *buffer, size_t len) {
+    if (conn->framing == FRAMING_UNKNOWN) {
+        if (conn->line_len == 0 && buffer[0] != BINPROTO_MAGIC[0]) {
+            conn->framing = FRAMING_TEXT;
+        } else {
+            size_t need = BINPROTO_MAGIC_LEN - conn->line_len;
+            size_t take = len < need ? len : need;
+
+            if (buffer_line(conn, buffer, take) < 0) return -1;
+            buffer += take;
+            len -= take;
+            if (conn->line_len < BINPROTO_MAGIC_LEN) return 0;
+            if (memcmp(conn->line, BINPROTO_MAGIC, BINPROTO_MAGIC_LEN) == 0) {
+                conn->framing = FRAMING_BINARY;
+                conn->line_len = 0;
+            } else {
+                // Not the magic after all: treat what was buffered as the start of a text line
+                conn->framing = FRAMING_TEXT;
+            }
+        }
+    }
+    if (conn->framing == FRAMING_BINARY) {
+        return handle_binary_input(conn, buffer, len);
+    }
+    return len ? handle_text_input(conn, buffer, len) : 0;
+}
+
+void client_serve(int connfd, bool binary) {
+    struct connection *conn;
+    char buffer[READ_CHUNK];
+    bool reading = true;
+
+    conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        perror("malloc failed");
+        return;
+    }
+    conn->connfd = connfd;
+    conn->delta = client_config.delta_replies;
+    conn->framing = binary ? FRAMING_BINARY : FRAMING_UNKNOWN;
+    STAILQ_INIT(&conn->replies);
+
+    for (;;) {
+        struct pollfd pfds[3];
+        nfds_t nfds = 1;
+        int shutdown_idx = -1, sub_idx = -1;
+        bool want_read;
+        int rc;
+
+        if (!STAILQ_EMPTY(&conn->replies) && flush_replies(conn) < 0) {
+            break;
+        }
+        want_read = reading && conn->queued < MAX_QUEUED_REPLIES;
+        if (!want_read && STAILQ_EMPTY(&conn->replies)) {
+            break;
+        }
+
+        pfds[0].fd = connfd;
+        pfds[0].events = (want_read ? POLLIN : 0) | (STAILQ_EMPTY(&conn->replies) ? 0 : POLLOUT);
+        pfds[0].revents = 0;
+        if (reading) {
+            // Once shutdown starts, stop taking requests but let queued replies finish
+            shutdown_idx = nfds++;
+            pfds[shutdown_idx].fd = shutdown_efd;
+            pfds[shutdown_idx].events = POLLIN;
+            pfds[shutdown_idx].revents = 0;
+        }
+        if (reading && conn->sub && conn->queued < MAX_QUEUED_REPLIES) {
+            sub_idx = nfds++;
+            pfds[sub_idx].fd = fanout_fd(conn->sub);
+            pfds[sub_idx].events = POLLIN;
+            pfds[sub_idx].revents = 0;
+        }
+        TRACE_BEGIN(read_wait, want_read);
+        rc = fiber_poll(pfds, nfds, -1);
+        TRACE_END(read_wait, pfds[0].revents);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
+        }
+        if (shutdown_idx >= 0 && (pfds[shutdown_idx].revents & POLLIN)) {
+            reading = false;
+        }
+        if (sub_idx >= 0 && (pfds[sub_idx].revents & POLLIN)) {
+            if (fanout_cut_off(conn->sub)) {
+                syslog(LOG_WARNING, "Disconnecting a subscriber that fell too far behind");
+                break;
+            }
+            if (queue_pushed(conn) < 0) break;
+        }
+#if !USE_AESD_CHAR_DEVICE
+        // Zero copy completions arrive on the error queue and raise POLLERR
+        if ((pfds[0].revents & POLLERR) && conn->zc_next != conn->zc_done &&
+            reap_zerocopy(conn) > 0) {
+            pfds[0].revents &= ~POLLERR;
+        }
+#endif
+        if (pfds[0].revents & (POLLERR | POLLNVAL)) {
+            break;
+        }
+        if (want_read && (pfds[0].revents & (POLLIN | POLLHUP))) {
+            ssize_t n = read(connfd, buffer, sizeof(buffer));
+
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if (n < 0) {
+                perror("read failed");
+                break;
+            }
+            if (n == 0) {
+                reading = false;
+            } else {
+                TRACE_BEGIN(handle_input, n);
+                rc = handle_input(conn, buffer, n);
+                TRACE_END(handle_input, conn->queued);
+                if (rc < 0) break;
+                if (rc > 0) reading = false;
+            }
+        }
+    }
+
+    // Keep a trailing unterminated packet, as earlier versions wrote data as it arrived; a
+    // follower's log only takes what the primary sends
+    if (conn->line_len && conn->framing != FRAMING_BINARY && !client_config.read_only) {
+        datastore_lock();
+        if (datastore_append(conn->line, conn->line_len) < 0) {
+            perror("writing to file failed");
+        }
+        datastore_unlock();
+    }
+
+    if (conn->sub) fanout_unsubscribe(conn->sub);
+    while (!STAILQ_EMPTY(&conn->replies)) {
+        free_reply(conn, STAILQ_FIRST(&conn->replies));
+    }
+#if !USE_AESD_CHAR_DEVICE
+    release_zerocopy(conn);
+#endif
+    free(conn->line);
+    free(conn);
+}
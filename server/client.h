@@ -0,0 +1,36 @@
+/**
+ * @file client.h
+ * @brief Per connection protocol handling for aesdsocket
+ */
+
+#ifndef AESDSOCKET_CLIENT_H
+#define AESDSOCKET_CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Options applied to every new connection, set from the command line.
+ */
+struct client_config {
+    bool delta_replies;   // Reply only with unseen data unless the client asks otherwise (-D)
+    size_t zerocopy_threshold;  // Send replies this large with MSG_ZEROCOPY in file mode, 0 never (-z)
+    bool read_only;       // Follower: packets are answered but not stored, appends fail (-F)
+    size_t subscribe_queue;  // Pushed messages a subscriber may have waiting (-q)
+    bool subscribe_drop;  // Drop messages for a full subscriber instead of disconnecting it (-Q)
+    bool no_subscribe;    // Refuse subscriptions: a shared char device log can't be tailed
+    size_t max_line_bytes;  // Longest text packet; a connection sending a longer one is closed (-L)
+};
+
+extern struct client_config client_config;
+
+/**
+ * Serve the connected, non-blocking socket @param connfd until the client disconnects or the
+ * server shuts down.  With @param binary the connection uses binary framing from the start,
+ * otherwise it is text unless the client opens with BINPROTO_MAGIC.
+ * Runs on its own thread or on a fiber: it only waits through fiber_poll.
+ * The caller owns and closes @param connfd.
+ */
+void client_serve(int connfd, bool binary);
+
+#endif /* AESDSOCKET_CLIENT_H */
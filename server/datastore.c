@@ -0,0 +1,389 @@
+/**
+ * @file datastore.c
+ * @brief Long lived descriptors and offset based I/O for the aesdsocket data path
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "aesdsocket.h"
+#include "datastore.h"
+#include "tierstore.h"
+#include "fanout.h"
+#include "trace.h"
+
+/**
+ * State every thread, and after datastore_share every worker process, must agree on.
+ */
+struct datastore_shared {
+    pthread_mutex_t lock;
+    pthread_cond_t appended;  // Broadcast after every append, with lock held
+    off_t data_size;      // End of the data file; the next append goes here (file mode)
+    struct datastore_stats stats;
+};
+
+static struct datastore_shared private_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .appended = PTHREAD_COND_INITIALIZER,
+};
+static struct datastore_shared *state = &private_state;
+static int shared_fd = -1;  // The memfd behind state once shared
+static int append_fd = -1;
+static int read_fd = -1;
+#if !USE_AESD_CHAR_DEVICE
+static bool tiered;
+
+#define MAP_MIN_LEN (1024 * 1024)
+
+static pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct datastore_map *current_map;  // Holds one reference of its own
+#endif
+
+int datastore_open(const char *path)
+{
+#if USE_AESD_CHAR_DEVICE
+    append_fd = open(path, O_WRONLY | O_CLOEXEC);
+#else
+    struct stat st;
+
+    // No O_APPEND: Linux ignores the pwrite offset on O_APPEND descriptors
+    append_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (append_fd >= 0) {
+        if (fstat(append_fd, &st) < 0) {
+            close(append_fd);
+            append_fd = -1;
+            return -1;
+        }
+        state->data_size = st.st_size;
+    }
+#endif
+    if (append_fd < 0) {
+        return -1;
+    }
+
+    read_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (read_fd < 0) {
+        int saved = errno;
+        close(append_fd);
+        append_fd = -1;
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+int datastore_open_tiered(const struct tier_config *config)
+{
+#if USE_AESD_CHAR_DEVICE
+    (void)config;
+    errno = ENOTSUP;
+    return -1;
+#else
+    if (tier_open(config) < 0) return -1;
+    tiered = true;
+    return 0;
+#endif
+}
+
+void datastore_close(void)
+{
+#if !USE_AESD_CHAR_DEVICE
+    if (tiered) {
+        tier_close();
+        tiered = false;
+        return;
+    }
+    pthread_mutex_lock(&map_mutex);
+    if (current_map) {
+        datastore_map_put(current_map);
+        current_map = NULL;
+    }
+    pthread_mutex_unlock(&map_mutex);
+#endif
+    if (append_fd >= 0) close(append_fd);
+    if (read_fd >= 0) close(read_fd);
+    if (shared_fd >= 0) close(shared_fd);
+    append_fd = read_fd = shared_fd = -1;
+}
+
+int datastore_share(void)
+{
+    struct datastore_shared *shared;
+    pthread_mutexattr_t attr;
+    pthread_condattr_t cond_attr;
+    int fd;
+
+#if !USE_AESD_CHAR_DEVICE
+    if (tiered) {
+        // The hot ring lives in this process's memory
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+    fd = memfd_create("aesdsocket-datastore", MFD_CLOEXEC);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, sizeof(*shared)) < 0) {
+        close(fd);
+        return -1;
+    }
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&shared->appended, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    shared->data_size = state->data_size;
+    shared->stats = state->stats;
+    state = shared;
+    shared_fd = fd;  // Kept so other processes can map it too
+    return 0;
+}
+
+int datastore_export(int fds[DATASTORE_NFDS])
+{
+    if (shared_fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    fds[0] = shared_fd;
+    fds[1] = append_fd;
+    fds[2] = read_fd;
+    return 0;
+}
+
+int datastore_adopt(const int fds[DATASTORE_NFDS])
+{
+    struct datastore_shared *shared;
+
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (shared == MAP_FAILED) return -1;
+    state = shared;
+    shared_fd = fds[0];
+    append_fd = fds[1];
+    read_fd = fds[2];
+    return 0;
+}
+
+/**
+ * Finish taking the lock, given the result @param rc of the call that took it.
+ */
+static void lock_acquired(int rc)
+{
+    if (rc == EOWNERDEAD) {
+        // A worker process died holding the lock.  data_size only moves once an append is
+        // complete, so dropping whatever it wrote past data_size restores a consistent log.
+        syslog(LOG_WARNING, "Recovering the datastore lock from a dead worker");
+#if !USE_AESD_CHAR_DEVICE
+        if (ftruncate(append_fd, state->data_size) < 0) {
+            syslog(LOG_ERR, "Failed to drop a partial append: %m");
+        }
+#endif
+        pthread_mutex_consistent(&state->lock);
+    }
+}
+
+void datastore_lock(void)
+{
+    TRACE_BEGIN(lock_wait, 0);
+    lock_acquired(pthread_mutex_lock(&state->lock));
+    TRACE_END(lock_wait, 0);
+}
+
+void datastore_unlock(void)
+{
+    pthread_mutex_unlock(&state->lock);
+    // Deliver what was published under the lock without holding it up
+    fanout_flush();
+}
+
+int datastore_append(const char *buf, size_t len)
+{
+    state->stats.appends++;
+    state->stats.bytes_appended += len;
+    TRACE_BEGIN(file_write, len);
+#if USE_AESD_CHAR_DEVICE
+    // The driver treats each write as one command; keep the packet in a single write
+    ssize_t n;
+
+    do {
+        n = write(append_fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+    TRACE_END(file_write, n);
+    if (n < 0) return -1;
+    if (shared_fd < 0) fanout_publish(buf, len);
+    return 0;
+#else
+    if (tiered) {
+        int rc = tier_append(buf, len);
+
+        TRACE_END(file_write, rc < 0 ? 0 : tier_end());
+        if (rc == 0) {
+            pthread_cond_broadcast(&state->appended);
+            fanout_publish(buf, len);
+        }
+        return rc;
+    }
+    off_t end = state->data_size;
+
+    const char *start = buf;
+
+    while (len > 0) {
+        ssize_t n = pwrite(append_fd, buf, len, end);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            TRACE_END(file_write, 0);
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        end += n;
+    }
+    // Commit only a complete append, so a crash mid-write never exposes part of one
+    __atomic_store_n(&state->data_size, end, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&state->appended);
+    // A shared log is published by each process's fan-out tail instead
+    if (shared_fd < 0) fanout_publish(start, buf - start);
+    TRACE_END(file_write, end);
+    return 0;
+#endif
+}
+
+ssize_t datastore_pread(char *buf, size_t len, off_t offset)
+{
+    ssize_t n;
+
+#if !USE_AESD_CHAR_DEVICE
+    if (tiered) return tier_pread(buf, len, offset);
+#endif
+    do {
+        n = pread(read_fd, buf, len, offset);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+off_t datastore_size(void)
+{
+#if USE_AESD_CHAR_DEVICE
+    return -1;
+#else
+    return tiered ? tier_end() : __atomic_load_n(&state->data_size, __ATOMIC_RELAXED);
+#endif
+}
+
+off_t datastore_base(void)
+{
+#if USE_AESD_CHAR_DEVICE
+    return 0;
+#else
+    return tiered ? tier_base() : 0;
+#endif
+}
+
+off_t datastore_wait(off_t offset, int timeout_ms)
+{
+    struct timespec deadline;
+    off_t size;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    datastore_lock();
+    while ((size = datastore_size()) <= offset) {
+        int rc = pthread_cond_timedwait(&state->appended, &state->lock, &deadline);
+
+        if (rc == ETIMEDOUT) break;
+        lock_acquired(rc);
+    }
+    datastore_unlock();
+    return datastore_size();
+}
+
+void datastore_get_stats(struct datastore_stats *out)
+{
+    datastore_lock();
+    *out = state->stats;
+    datastore_unlock();
+}
+
+int datastore_read_fd(void)
+{
+    return read_fd;
+}
+
+struct datastore_map *datastore_map_get(off_t end)
+{
+#if USE_AESD_CHAR_DEVICE
+    (void)end;
+    errno = ENOTSUP;
+    return NULL;
+#else
+    struct datastore_map *map;
+    size_t len;
+    void *base;
+
+    if (tiered) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    pthread_mutex_lock(&map_mutex);
+    if (current_map && current_map->len >= (size_t)end) {
+        map = current_map;
+        __atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&map_mutex);
+        return map;
+    }
+
+    // Map well past the end so a growing file is remapped only now and then
+    len = (size_t)end * 2;
+    if (len < MAP_MIN_LEN) len = MAP_MIN_LEN;
+    base = mmap(NULL, len, PROT_READ, MAP_SHARED, read_fd, 0);
+    if (base == MAP_FAILED) {
+        pthread_mutex_unlock(&map_mutex);
+        return NULL;
+    }
+    map = malloc(sizeof(*map));
+    if (!map) {
+        munmap(base, len);
+        pthread_mutex_unlock(&map_mutex);
+        return NULL;
+    }
+    map->base = base;
+    map->len = len;
+    map->refs = 2;  // The caller's and current_map's
+    if (current_map) datastore_map_put(current_map);
+    current_map = map;
+    pthread_mutex_unlock(&map_mutex);
+    return map;
+#endif
+}
+
+void datastore_map_put(struct datastore_map *map)
+{
+    if (__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap((void *)map->base, map->len);
+        free(map);
+    }
+}
@@ -0,0 +1,135 @@
+/**
+ * @file datastore.h
+ * @brief Shared descriptors for the aesdsocket data file or char device
+ *
+ * The data file is opened once at startup: one descriptor for appends and one for reads.
+ * Appends use an explicit offset (pwrite) in file mode and reads always use pread, so no
+ * per packet open/close or lseek is needed and both descriptors can be shared by every thread.
+ */
+
+#ifndef AESDSOCKET_DATASTORE_H
+#define AESDSOCKET_DATASTORE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Open the shared descriptors for @param path.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int datastore_open(const char *path);
+
+struct tier_config;
+
+/**
+ * Keep the history in a tiered store (see tierstore.h) instead of a single data file.
+ * File mode only; datastore_read_fd and datastore_map_get are unavailable in this mode.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int datastore_open_tiered(const struct tier_config *config);
+
+void datastore_close(void);
+
+/**
+ * Move the lock, the data file end, the append condition and the counters into a shared
+ * memory region (a memfd mapping) so worker processes given its descriptors
+ * (datastore_export, datastore_adopt) append to the same log.  The lock is a process shared
+ * robust mutex: if a worker dies holding it, the next locker drops the dead worker's partial
+ * append and carries on.  Not available with a tiered store.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int datastore_share(void);
+
+// Descriptors that make up a shared datastore: the memfd, the append and the read descriptor
+#define DATASTORE_NFDS 3
+
+/**
+ * Fill @param fds with the descriptors another process needs to adopt this datastore.
+ * @return 0 on success, -1 with errno EINVAL if datastore_share has not been called
+ */
+int datastore_export(int fds[DATASTORE_NFDS]);
+
+/**
+ * Use a datastore exported by another process instead of opening one.  Both processes share
+ * the lock and the end of the log, so their appends interleave safely.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int datastore_adopt(const int fds[DATASTORE_NFDS]);
+
+/**
+ * Serialize appends and the replies that must observe them.  Unlocking delivers what the
+ * appends published to subscribers (fanout_flush), after the lock is released.
+ */
+void datastore_lock(void);
+void datastore_unlock(void);
+
+/**
+ * Append @param len bytes of @param buf and publish them to subscribers (fanout.h), unless
+ * the datastore is shared, whose appends the fan-out tail publishes.  Caller holds the
+ * datastore lock.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int datastore_append(const char *buf, size_t len);
+
+/**
+ * Read up to @param len bytes at @param offset.  Safe to call concurrently with appends,
+ * although callers normally hold the lock so a reply reflects their own append.
+ * @return bytes read, 0 at end of data, -1 on failure; ENODATA means @param offset is below
+ * datastore_base()
+ */
+ssize_t datastore_pread(char *buf, size_t len, off_t offset);
+
+/**
+ * @return bytes stored in file mode, or -1 in char device mode where the driver decides how
+ * much history is kept
+ */
+off_t datastore_size(void);
+
+/**
+ * @return the oldest offset still stored: nonzero only once a tiered store's retention
+ * policy has deleted history
+ */
+off_t datastore_base(void);
+
+/**
+ * Wait up to @param timeout_ms milliseconds for the data to grow past @param offset.  File
+ * mode only; appends made by other workers after datastore_share wake the wait too.
+ * @return the current size
+ */
+off_t datastore_wait(off_t offset, int timeout_ms);
+
+struct datastore_stats {
+    unsigned long long appends;
+    unsigned long long bytes_appended;
+};
+
+/**
+ * Copy the append counters into @param stats.  Takes the datastore lock.
+ */
+void datastore_get_stats(struct datastore_stats *stats);
+
+/**
+ * @return the descriptor used for reads, for zero copy transfers
+ */
+int datastore_read_fd(void);
+
+/**
+ * A shared read only mapping of the data file.  The file is append only, so mapped bytes
+ * never change and the mapping can back MSG_ZEROCOPY sends.
+ */
+struct datastore_map {
+    const char *base;
+    size_t len;           // Bytes mapped; only those below datastore_size() may be touched
+    int refs;
+};
+
+/**
+ * Get a mapping covering at least [0, @param end), remapping when the file has outgrown the
+ * current one.  Superseded mappings stay valid until their last reference is put.
+ * @return the mapping, or NULL with errno set (ENOTSUP in char device or tiered mode)
+ */
+struct datastore_map *datastore_map_get(off_t end);
+
+void datastore_map_put(struct datastore_map *map);
+
+#endif /* AESDSOCKET_DATASTORE_H */
@@ -0,0 +1,283 @@
+/**
+ * @file fanout.c
+ * @brief Refcounted message fan-out to subscribed connections
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+
+#include "datastore.h"
+#include "fanout.h"
+
+#define TAIL_CHUNK (64 * 1024)
+#define TAIL_WAIT_MS 100      // Longest the tail goes without checking whether to stop
+
+struct subscriber {
+    LIST_ENTRY(subscriber) entries;
+    pthread_mutex_t lock;     // Protects the queue against the consumer
+    struct fanout_msg **queue;  // Ring of max_queued messages
+    size_t max_queued;
+    size_t head;
+    size_t count;
+    bool drop;
+    bool cut_off;
+    unsigned long dropped;
+    int efd;
+};
+
+static pthread_mutex_t subscribers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(subscriber_list, subscriber) subscribers = LIST_HEAD_INITIALIZER(subscribers);
+static int nsubscribers;  // Read without the lock so publishing is free when nobody listens
+
+// Messages published under the datastore lock and not yet delivered, oldest first
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fanout_msg *pending_head;
+static struct fanout_msg **pending_tail = &pending_head;
+static bool have_pending;  // Read without the lock so flushing is free when nothing is queued
+
+static pthread_t tail_thread;
+static bool tail_started;
+static bool tail_stop;
+
+static void wake(struct subscriber *sub) {
+    uint64_t one = 1;
+
+    if (write(sub->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        syslog(LOG_ERR, "Failed to wake a subscriber: %m");
+    }
+}
+
+void fanout_publish(const char *buf, size_t len) {
+    struct fanout_msg *msg;
+
+    if (__atomic_load_n(&nsubscribers, __ATOMIC_RELAXED) == 0) return;
+    msg = malloc(sizeof(*msg) + len);
+    if (!msg) {
+        syslog(LOG_ERR, "Failed to allocate a fan-out message");
+        return;
+    }
+    memcpy(msg->data, buf, len);
+    msg->len = len;
+    msg->refs = 1;  // The pending list's, until every subscriber has its own
+    msg->next = NULL;
+
+    pthread_mutex_lock(&pending_mutex);
+    *pending_tail = msg;
+    pending_tail = &msg->next;
+    __atomic_store_n(&have_pending, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pending_mutex);
+}
+
+/**
+ * Queue a reference to @param msg for every subscriber.  Caller holds subscribers_mutex.
+ */
+static void deliver(struct fanout_msg *msg) {
+    struct subscriber *sub;
+
+    LIST_FOREACH(sub, &subscribers, entries) {
+        pthread_mutex_lock(&sub->lock);
+        if (sub->cut_off) {
+            // Nothing more for it
+        } else if (sub->count == sub->max_queued) {
+            if (sub->drop) {
+                sub->dropped++;
+            } else {
+                sub->cut_off = true;
+                wake(sub);
+            }
+        } else {
+            sub->queue[(sub->head + sub->count) % sub->max_queued] = msg;
+            __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+            if (sub->count++ == 0) wake(sub);
+        }
+        pthread_mutex_unlock(&sub->lock);
+    }
+}
+
+void fanout_flush(void) {
+    struct fanout_msg *msg, *next;
+
+    if (!__atomic_load_n(&have_pending, __ATOMIC_ACQUIRE)) return;
+    // Whoever holds subscribers_mutex takes the whole list, so batches go out in order
+    pthread_mutex_lock(&subscribers_mutex);
+    pthread_mutex_lock(&pending_mutex);
+    msg = pending_head;
+    pending_head = NULL;
+    pending_tail = &pending_head;
+    __atomic_store_n(&have_pending, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pending_mutex);
+    for (; msg; msg = next) {
+        next = msg->next;
+        deliver(msg);
+        fanout_put(msg);
+    }
+    pthread_mutex_unlock(&subscribers_mutex);
+}
+
+/**
+ * Publish @param len bytes read from the log, one message per line.
+ */
+static void publish_lines(const char *buf, size_t len) {
+    while (len > 0) {
+        const char *newline = memchr(buf, '\n', len);
+        size_t line = newline ? (size_t)(newline - buf) + 1 : len;
+
+        fanout_publish(buf, line);
+        buf += line;
+        len -= line;
+    }
+}
+
+static void *tail_thread_fn(void *args) {
+    char *buf = malloc(TAIL_CHUNK);
+    off_t offset = datastore_size();
+
+    (void)args;
+    if (!buf) {
+        syslog(LOG_ERR, "Failed to allocate the fan-out tail buffer");
+        return NULL;
+    }
+    while (!__atomic_load_n(&tail_stop, __ATOMIC_ACQUIRE)) {
+        off_t end = datastore_wait(offset, TAIL_WAIT_MS);
+
+        if (__atomic_load_n(&nsubscribers, __ATOMIC_RELAXED) == 0) {
+            // Nobody to tell; subscribers only get what is stored after they subscribe
+            offset = end;
+            continue;
+        }
+        while (offset < end) {
+            size_t want = end - offset < TAIL_CHUNK ? end - offset : TAIL_CHUNK;
+            ssize_t n = datastore_pread(buf, want, offset);
+            size_t used;
+
+            if (n <= 0) {
+                syslog(LOG_ERR, "Can't read offset %lld for subscribers: %s", (long long)offset,
+                       n < 0 ? strerror(errno) : "end of data");
+                offset = end;
+                break;
+            }
+            used = n;
+            if (offset + n < end) {
+                // Leave a line cut by the chunk for the next read, unless it fills the chunk
+                const char *last = memrchr(buf, '\n', n);
+
+                if (last) used = last - buf + 1;
+            }
+            publish_lines(buf, used);
+            offset += used;
+        }
+        fanout_flush();
+    }
+    free(buf);
+    return NULL;
+}
+
+int fanout_start_tail(void) {
+    int rc;
+
+    __atomic_store_n(&tail_stop, false, __ATOMIC_RELAXED);
+    rc = pthread_create(&tail_thread, NULL, tail_thread_fn, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    tail_started = true;
+    return 0;
+}
+
+void fanout_stop_tail(void) {
+    if (!tail_started) return;
+    __atomic_store_n(&tail_stop, true, __ATOMIC_RELEASE);
+    pthread_join(tail_thread, NULL);
+    tail_started = false;
+}
+
+struct subscriber *fanout_subscribe(size_t max_queued, bool drop) {
+    struct subscriber *sub = calloc(1, sizeof(*sub));
+
+    if (!sub) return NULL;
+    sub->max_queued = max_queued ? max_queued : 1;
+    sub->queue = malloc(sub->max_queued * sizeof(*sub->queue));
+    sub->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (!sub->queue || sub->efd < 0) {
+        int saved = errno;
+
+        if (sub->efd >= 0) close(sub->efd);
+        free(sub->queue);
+        free(sub);
+        errno = saved;
+        return NULL;
+    }
+    sub->drop = drop;
+    pthread_mutex_init(&sub->lock, NULL);
+
+    pthread_mutex_lock(&subscribers_mutex);
+    LIST_INSERT_HEAD(&subscribers, sub, entries);
+    __atomic_add_fetch(&nsubscribers, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&subscribers_mutex);
+    return sub;
+}
+
+void fanout_unsubscribe(struct subscriber *sub) {
+    pthread_mutex_lock(&subscribers_mutex);
+    LIST_REMOVE(sub, entries);
+    __atomic_sub_fetch(&nsubscribers, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&subscribers_mutex);
+
+    if (sub->dropped) {
+        syslog(LOG_INFO, "Subscriber dropped %lu messages", sub->dropped);
+    }
+    while (sub->count > 0) {
+        fanout_put(sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % sub->max_queued;
+        sub->count--;
+    }
+    pthread_mutex_destroy(&sub->lock);
+    close(sub->efd);
+    free(sub->queue);
+    free(sub);
+}
+
+int fanout_fd(const struct subscriber *sub) {
+    return sub->efd;
+}
+
+struct fanout_msg *fanout_next(struct subscriber *sub) {
+    struct fanout_msg *msg = NULL;
+    uint64_t value;
+
+    pthread_mutex_lock(&sub->lock);
+    if (sub->count > 0) {
+        msg = sub->queue[sub->head];
+        sub->head = (sub->head + 1) % sub->max_queued;
+        sub->count--;
+    } else if (read(sub->efd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        // Reset the wakeup only once the queue is empty; a later publish sets it again
+        syslog(LOG_ERR, "Failed to clear a subscriber wakeup: %m");
+    }
+    pthread_mutex_unlock(&sub->lock);
+    return msg;
+}
+
+bool fanout_cut_off(struct subscriber *sub) {
+    bool cut_off;
+
+    pthread_mutex_lock(&sub->lock);
+    cut_off = sub->cut_off;
+    pthread_mutex_unlock(&sub->lock);
+    return cut_off;
+}
+
+void fanout_put(struct fanout_msg *msg) {
+    if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(msg);
+    }
+}
@@ -0,0 +1,81 @@
+/**
+ * @file fanout.h
+ * @brief Pushing newly stored data to subscribed connections
+ *
+ * Every successful append is published once: it is copied into one refcounted message and a
+ * reference is queued to each subscriber, so a line costs one allocation and one copy however
+ * many connections watch.  Publishing only queues the message, in append order, under the
+ * datastore lock; the walk over the subscribers happens in fanout_flush once the lock is
+ * released, so appends don't wait on it.  Each subscriber has a bounded queue and an eventfd
+ * that becomes readable when the queue goes from empty to non-empty, or when the subscriber is
+ * cut off.  A subscriber whose queue is full either loses the new message (drop policy) or is
+ * cut off (disconnect policy).
+ *
+ * Once the datastore is shared with other processes (pre-forked workers, or both generations
+ * of a hot restart), an append stored by one process must reach the subscribers of all of
+ * them.  Each serving process then publishes from a tail thread (fanout_start_tail) that
+ * follows the shared log with datastore_wait, one message per line, instead of from
+ * datastore_append.  File mode only: in char device mode a shared datastore can't be tailed,
+ * so subscriptions are refused there.
+ */
+
+#ifndef AESDSOCKET_FANOUT_H
+#define AESDSOCKET_FANOUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct fanout_msg {
+    int refs;
+    struct fanout_msg *next;  // Published but not yet delivered
+    size_t len;
+    char data[];
+};
+
+struct subscriber;
+
+/**
+ * Queue @param len bytes of @param buf for every subscriber.  Callers serialize publishing
+ * (the datastore lock), which keeps every subscriber's messages in append order.
+ */
+void fanout_publish(const char *buf, size_t len);
+
+/**
+ * Deliver every queued message to the subscribers, in the order published.  Call without the
+ * datastore lock after publishing.
+ */
+void fanout_flush(void);
+
+/**
+ * Publish the lines appended to the shared log from now on, by any process, until
+ * fanout_stop_tail.  File mode only.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int fanout_start_tail(void);
+
+void fanout_stop_tail(void);
+
+/**
+ * Subscribe with room for @param max_queued messages, dropping new messages when full if
+ * @param drop is set and cutting the subscriber off otherwise.
+ * @return the subscriber, or NULL with errno set on failure
+ */
+struct subscriber *fanout_subscribe(size_t max_queued, bool drop);
+
+void fanout_unsubscribe(struct subscriber *sub);
+
+// Descriptor to poll for POLLIN; readable when fanout_next has something to report
+int fanout_fd(const struct subscriber *sub);
+
+/**
+ * Take the oldest queued message; the caller owns one reference to it.
+ * @return the message, or NULL when the queue is empty
+ */
+struct fanout_msg *fanout_next(struct subscriber *sub);
+
+// True once the disconnect policy has cut @param sub off
+bool fanout_cut_off(struct subscriber *sub);
+
+void fanout_put(struct fanout_msg *msg);
+
+#endif /* AESDSOCKET_FANOUT_H */
@@ -0,0 +1,573 @@
+/**
+ * @file fiber.c
+ * @brief Fiber scheduler, context switch and stack pool
+ *
+ * On x86_64 fibers switch with a few instructions saving the callee-saved registers; other
+ * architectures fall back to ucontext, which is slower as swapcontext also saves the signal
+ * mask with a system call.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#include "fiber.h"
+
+#define FIBER_EVENTS 64       // epoll events handled per wait
+#define FIBER_MAX_FDS 4       // Descriptors kept registered per fiber
+#define FIBER_STACK_POOL 256  // Free stacks kept for reuse
+
+#if defined(__x86_64__)
+struct fiber_ctx {
+    void *sp;
+};
+
+/*
+ * fiber_switch(from, to): push the callee-saved registers and the SSE/x87 control words,
+ * save the stack pointer in from->sp, then restore the same from to->sp and return into it.
+ */
+void fiber_switch(struct fiber_ctx *from, struct fiber_ctx *to);
+__asm__(
+    ".text\n"
+    ".globl fiber_switch\n"
+    ".type fiber_switch,@function\n"
+    "fiber_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size fiber_switch, .-fiber_switch\n");
+#else
+struct fiber_ctx {
+    ucontext_t uc;
+};
+
+static void fiber_switch(struct fiber_ctx *from, struct fiber_ctx *to) {
+    swapcontext(&from->uc, &to->uc);
+}
+#endif
+
+enum fiber_state {
+    FIBER_NEW,            // Queued, never run; may be stolen
+    FIBER_READY,
+    FIBER_RUNNING,
+    FIBER_WAITING,        // Parked in fiber_poll
+    FIBER_DEAD,
+};
+
+struct scheduler;
+
+struct fiber {
+    TAILQ_ENTRY(fiber) link;  // Fresh or ready queue
+    LIST_ENTRY(fiber) all;    // Started fibers of the scheduler
+    struct fiber_ctx ctx;
+    char *stack;              // Lowest usable byte; the guard page is below it
+    void (*fn)(void *);
+    void *arg;
+    enum fiber_state state;
+    int armed[FIBER_MAX_FDS]; // Descriptors registered with the scheduler's epoll
+    int narmed;
+};
+TAILQ_HEAD(fiber_queue, fiber);
+
+struct scheduler {
+    pthread_t thread;
+    int epfd;
+    int kick_efd;             // Written to wake the scheduler from epoll_wait
+    int sleeping;             // In, or about to enter, a blocking epoll_wait
+    pthread_mutex_t fresh_mutex;
+    struct fiber_queue fresh; // Not yet started, shared with spawners and thieves
+    int nfresh;
+    struct fiber_queue ready; // Only touched by the scheduler thread
+    LIST_HEAD(, fiber) fibers;
+    int nfibers;
+    struct fiber_ctx ctx;     // Where fibers switch back to
+    struct fiber *current;
+    bool woken_all;           // wake_fd has fired
+    bool cancelled;           // Waits have been cancelled
+};
+
+static struct {
+    struct scheduler *scheds;
+    int nsched;
+    int wake_fd;
+    int stopping;
+    int cancel;
+    unsigned int next;
+} runtime = { .wake_fd = -1 };
+
+static __thread struct scheduler *this_sched;
+
+// Markers for the epoll events that aren't fibers
+static char kick_marker, wake_marker;
+
+static pthread_mutex_t stack_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *stack_pool;      // Free stacks, linked through their first word
+static int stack_pool_len;
+
+static char *stack_alloc(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    char *base;
+
+    pthread_mutex_lock(&stack_mutex);
+    if (stack_pool) {
+        char *stack = stack_pool;
+        stack_pool = *(void **)stack;
+        stack_pool_len--;
+        pthread_mutex_unlock(&stack_mutex);
+        return stack;
+    }
+    pthread_mutex_unlock(&stack_mutex);
+
+    base = mmap(NULL, FIBER_STACK_SIZE + page, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    // Overflowing the stack faults on the guard page instead of corrupting the next one
+    if (mprotect(base, page, PROT_NONE) < 0) {
+        munmap(base, FIBER_STACK_SIZE + page);
+        return NULL;
+    }
+    return base + page;
+}
+
+static void stack_free(char *stack) {
+    long page = sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&stack_mutex);
+    if (stack_pool_len < FIBER_STACK_POOL) {
+        *(void **)stack = stack_pool;
+        stack_pool = stack;
+        stack_pool_len++;
+        stack = NULL;
+    }
+    pthread_mutex_unlock(&stack_mutex);
+    if (stack) munmap(stack - page, FIBER_STACK_SIZE + page);
+}
+
+static void kick(struct scheduler *s) {
+    uint64_t one = 1;
+
+    if (write(s->kick_efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("fiber kick failed");
+    }
+}
+
+/**
+ * Entry point of every fiber; switches back to the scheduler for good when fn returns.
+ */
+static void __attribute__((noreturn)) fiber_trampoline(void) {
+    struct scheduler *s = this_sched;
+    struct fiber *f = s->current;
+
+    f->fn(f->arg);
+    f->state = FIBER_DEAD;
+    fiber_switch(&f->ctx, &s->ctx);
+    abort();  // A dead fiber is never resumed
+}
+
+/**
+ * Give the new fiber @param f a stack and an initial context that enters fiber_trampoline.
+ * Nothing here depends on the thread, so the fiber can start on any scheduler.
+ */
+static int fiber_prepare(struct fiber *f) {
+    f->stack = stack_alloc();
+    if (!f->stack) return -1;
+#if defined(__x86_64__)
+    uintptr_t top = ((uintptr_t)f->stack + FIBER_STACK_SIZE) & ~(uintptr_t)15;
+    uint64_t *sp = (uint64_t *)(top - 16);
+
+    // Frame popped by fiber_switch: control words, six registers, then the return address
+    sp[0] = (uint64_t)(uintptr_t)fiber_trampoline;
+    sp -= 6;
+    memset(sp, 0, 6 * sizeof(*sp));
+    sp--;
+    *sp = 0x037f00001f80ull;  // Default x87 control word and MXCSR
+    f->ctx.sp = sp;
+#else
+    if (getcontext(&f->ctx.uc) < 0) {
+        stack_free(f->stack);
+        return -1;
+    }
+    f->ctx.uc.uc_stack.ss_sp = f->stack;
+    f->ctx.uc.uc_stack.ss_size = FIBER_STACK_SIZE;
+    f->ctx.uc.uc_link = NULL;
+    makecontext(&f->ctx.uc, fiber_trampoline, 0);
+#endif
+    return 0;
+}
+
+static void disarm_all(struct scheduler *s, struct fiber *f) {
+    int i;
+
+    // Errors are expected: the fiber has usually closed its descriptors already
+    for (i = 0; i < f->narmed; i++) {
+        epoll_ctl(s->epfd, EPOLL_CTL_DEL, f->armed[i], NULL);
+    }
+    f->narmed = 0;
+}
+
+static void run_fiber(struct scheduler *s, struct fiber *f) {
+    s->current = f;
+    f->state = FIBER_RUNNING;
+    fiber_switch(&s->ctx, &f->ctx);
+    s->current = NULL;
+
+    if (f->state == FIBER_DEAD) {
+        disarm_all(s, f);
+        LIST_REMOVE(f, all);
+        s->nfibers--;
+        stack_free(f->stack);
+        free(f);
+    }
+}
+
+static void make_ready(struct scheduler *s, struct fiber *f) {
+    if (f->state == FIBER_WAITING) {
+        f->state = FIBER_READY;
+        TAILQ_INSERT_TAIL(&s->ready, f, link);
+    }
+}
+
+static void wake_all(struct scheduler *s) {
+    struct fiber *f;
+
+    LIST_FOREACH(f, &s->fibers, all) {
+        make_ready(s, f);
+    }
+}
+
+/**
+ * Take a fresh fiber from this scheduler, or steal the newest one queued on another.
+ */
+static struct fiber *take_fresh(struct scheduler *s) {
+    int i;
+
+    for (i = 0; i < runtime.nsched; i++) {
+        struct scheduler *victim = &runtime.scheds[(s - runtime.scheds + i) % runtime.nsched];
+        struct fiber *f = NULL;
+
+        if (__atomic_load_n(&victim->nfresh, __ATOMIC_SEQ_CST) == 0) continue;
+        pthread_mutex_lock(&victim->fresh_mutex);
+        f = victim == s ? TAILQ_FIRST(&victim->fresh) : TAILQ_LAST(&victim->fresh, fiber_queue);
+        if (f) {
+            TAILQ_REMOVE(&victim->fresh, f, link);
+            __atomic_sub_fetch(&victim->nfresh, 1, __ATOMIC_SEQ_CST);
+        }
+        pthread_mutex_unlock(&victim->fresh_mutex);
+        if (f) return f;
+    }
+    return NULL;
+}
+
+static bool fresh_pending(void) {
+    int i;
+
+    for (i = 0; i < runtime.nsched; i++) {
+        if (__atomic_load_n(&runtime.scheds[i].nfresh, __ATOMIC_SEQ_CST)) return true;
+    }
+    return false;
+}
+
+static void handle_events(struct scheduler *s, struct epoll_event *events, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        void *ptr = events[i].data.ptr;
+
+        if (ptr == &kick_marker) {
+            uint64_t count;
+
+            if (read(s->kick_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                perror("fiber kick read failed");
+            }
+        } else if (ptr == &wake_marker) {
+            // Level triggered and never drained; stop watching it once every fiber has seen it
+            epoll_ctl(s->epfd, EPOLL_CTL_DEL, runtime.wake_fd, NULL);
+            s->woken_all = true;
+            wake_all(s);
+        } else {
+            make_ready(s, ptr);
+        }
+    }
+    if (!s->cancelled && __atomic_load_n(&runtime.cancel, __ATOMIC_ACQUIRE)) {
+        s->cancelled = true;
+        wake_all(s);
+    }
+}
+
+static void *scheduler_thread(void *arg) {
+    struct scheduler *s = arg;
+    struct epoll_event events[FIBER_EVENTS];
+
+    this_sched = s;
+    for (;;) {
+        struct fiber *f;
+        int timeout, n;
+
+        while ((f = TAILQ_FIRST(&s->ready)) != NULL) {
+            TAILQ_REMOVE(&s->ready, f, link);
+            run_fiber(s, f);
+        }
+
+        f = take_fresh(s);
+        if (f) {
+            LIST_INSERT_HEAD(&s->fibers, f, all);
+            s->nfibers++;
+            run_fiber(s, f);
+        }
+
+        if (__atomic_load_n(&runtime.stopping, __ATOMIC_ACQUIRE) && s->nfibers == 0 &&
+            TAILQ_EMPTY(&s->ready) && !fresh_pending()) {
+            break;
+        }
+
+        // Announce sleeping before the last look at the fresh queues so spawns can't be missed
+        __atomic_store_n(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+        timeout = (!TAILQ_EMPTY(&s->ready) || fresh_pending()) ? 0 : -1;
+        n = epoll_wait(s->epfd, events, FIBER_EVENTS, timeout);
+        __atomic_store_n(&s->sleeping, 0, __ATOMIC_SEQ_CST);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        handle_events(s, events, n);
+    }
+    return NULL;
+}
+
+int fiber_runtime_start(int nsched, int wake_fd, bool pin) {
+    struct epoll_event ev;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    runtime.scheds = calloc(nsched, sizeof(*runtime.scheds));
+    if (!runtime.scheds) return -1;
+    runtime.nsched = nsched;
+    runtime.wake_fd = wake_fd;
+
+    for (i = 0; i < nsched; i++) {
+        struct scheduler *s = &runtime.scheds[i];
+        pthread_attr_t attr;
+        cpu_set_t cpus;
+
+        pthread_mutex_init(&s->fresh_mutex, NULL);
+        TAILQ_INIT(&s->fresh);
+        TAILQ_INIT(&s->ready);
+        LIST_INIT(&s->fibers);
+        s->epfd = epoll_create1(EPOLL_CLOEXEC);
+        s->kick_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (s->epfd < 0 || s->kick_efd < 0) {
+            perror("fiber scheduler setup failed");
+            return -1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &kick_marker;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->kick_efd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            return -1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wake_marker;
+        if (wake_fd >= 0 && epoll_ctl(s->epfd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            return -1;
+        }
+
+        pthread_attr_init(&attr);
+        if (pin && ncpu > 0) {
+            CPU_ZERO(&cpus);
+            CPU_SET(i % ncpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        if (pthread_create(&s->thread, &attr, scheduler_thread, s) != 0) {
+            pthread_attr_destroy(&attr);
+            perror("fiber scheduler thread creation failed");
+            return -1;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return 0;
+}
+
+int fiber_spawn(void (*fn)(void *), void *arg) {
+    struct scheduler *s = NULL;
+    struct fiber *f;
+    int i;
+
+    if (__atomic_load_n(&runtime.stopping, __ATOMIC_ACQUIRE)) {
+        errno = ESHUTDOWN;
+        return -1;
+    }
+    f = calloc(1, sizeof(*f));
+    if (!f) return -1;
+    f->fn = fn;
+    f->arg = arg;
+    f->state = FIBER_NEW;
+    if (fiber_prepare(f) < 0) {
+        free(f);
+        return -1;
+    }
+
+    // Prefer an idle scheduler; otherwise spread round robin and let idle ones steal
+    for (i = 0; i < runtime.nsched && !s; i++) {
+        if (__atomic_load_n(&runtime.scheds[i].sleeping, __ATOMIC_SEQ_CST)) {
+            s = &runtime.scheds[i];
+        }
+    }
+    if (!s) {
+        s = &runtime.scheds[__atomic_fetch_add(&runtime.next, 1, __ATOMIC_RELAXED) % runtime.nsched];
+    }
+
+    pthread_mutex_lock(&s->fresh_mutex);
+    TAILQ_INSERT_TAIL(&s->fresh, f, link);
+    __atomic_add_fetch(&s->nfresh, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&s->fresh_mutex);
+
+    if (__atomic_load_n(&s->sleeping, __ATOMIC_SEQ_CST)) {
+        kick(s);
+    }
+    return 0;
+}
+
+/**
+ * Register @param fd for one wakeup of the current fiber on @param events.
+ */
+static int arm(struct scheduler *s, struct fiber *f, int fd, short events) {
+    struct epoll_event ev = {
+        .events = (events & (POLLIN | POLLOUT | POLLPRI)) | EPOLLONESHOT,
+        .data.ptr = f,
+    };
+    int i;
+
+    for (i = 0; i < f->narmed; i++) {
+        if (f->armed[i] == fd) break;
+    }
+    if (i < f->narmed) {
+        if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) == 0) return 0;
+        if (errno != ENOENT) return -1;
+        // Closed and reopened since it was armed; register it again
+        return epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        if (errno != EEXIST || epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) return -1;
+    }
+    if (f->narmed == FIBER_MAX_FDS) {
+        // Forget the oldest registration to make room
+        epoll_ctl(s->epfd, EPOLL_CTL_DEL, f->armed[0], NULL);
+        memmove(f->armed, f->armed + 1, (FIBER_MAX_FDS - 1) * sizeof(f->armed[0]));
+        f->narmed--;
+    }
+    f->armed[f->narmed++] = fd;
+    return 0;
+}
+
+int fiber_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    struct scheduler *s = this_sched;
+    struct fiber *f = s ? s->current : NULL;
+
+    if (!f || timeout == 0) {
+        return poll(fds, nfds, timeout);
+    }
+    if (timeout > 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (;;) {
+        nfds_t i;
+        int n;
+
+        if (s->cancelled) {
+            errno = ECANCELED;
+            return -1;
+        }
+        n = poll(fds, nfds, 0);
+        if (n != 0) return n;
+
+        for (i = 0; i < nfds; i++) {
+            // wake_fd is watched once per scheduler, which resumes every fiber when it fires
+            if (fds[i].fd < 0 || fds[i].fd == runtime.wake_fd) continue;
+            if (arm(s, f, fds[i].fd, fds[i].events) < 0) return -1;
+        }
+        f->state = FIBER_WAITING;
+        fiber_switch(&f->ctx, &s->ctx);
+    }
+}
+
+void fiber_runtime_stop(long drain_ms) {
+    struct timespec deadline;
+    bool *joined;
+    int i;
+
+    __atomic_store_n(&runtime.stopping, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < runtime.nsched; i++) {
+        kick(&runtime.scheds[i]);
+    }
+
+    joined = calloc(runtime.nsched, sizeof(*joined));
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += drain_ms / 1000;
+    deadline.tv_nsec += (drain_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    for (i = 0; i < runtime.nsched; i++) {
+        if (joined && pthread_timedjoin_np(runtime.scheds[i].thread, NULL, &deadline) == 0) {
+            joined[i] = true;
+        }
+    }
+
+    // Past the deadline: fail every parked fiber's wait so it unwinds and exits
+    __atomic_store_n(&runtime.cancel, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < runtime.nsched; i++) {
+        if (!joined || !joined[i]) {
+            kick(&runtime.scheds[i]);
+            pthread_join(runtime.scheds[i].thread, NULL);
+        }
+    }
+
+    for (i = 0; i < runtime.nsched; i++) {
+        close(runtime.scheds[i].epfd);
+        close(runtime.scheds[i].kick_efd);
+        pthread_mutex_destroy(&runtime.scheds[i].fresh_mutex);
+    }
+    free(joined);
+    free(runtime.scheds);
+    runtime.scheds = NULL;
+    runtime.nsched = 0;
+}
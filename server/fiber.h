@@ -0,0 +1,55 @@
+/**
+ * @file fiber.h
+ * @brief Stackful fibers on per-core epoll schedulers
+ *
+ * Lets the straight-line connection code in client.c serve many idle connections without an
+ * OS thread each.  Every scheduler thread owns an epoll instance and a ready queue; a fiber
+ * that would block in fiber_poll registers its descriptors with its scheduler and switches
+ * away until one becomes ready.
+ *
+ * New fibers are queued on an idle (or the next) scheduler and may be stolen by any idle
+ * scheduler until they first run.  From then on a fiber stays on its scheduler: code on the
+ * fiber may cache thread-local addresses such as errno's across a switch, so migrating a
+ * started fiber to another thread would not be safe.
+ *
+ * Regular file I/O (the data file, the char device) can't be waited on with epoll and runs
+ * directly on the scheduler thread.
+ */
+
+#ifndef AESDSOCKET_FIBER_H
+#define AESDSOCKET_FIBER_H
+
+#include <poll.h>
+#include <stdbool.h>
+
+// Usable stack per fiber; stacks are pooled and have a guard page below them
+#define FIBER_STACK_SIZE (64 * 1024)
+
+/**
+ * Start @param nsched scheduler threads, pinned to CPUs round robin when @param pin is set.
+ * Parked fibers are resumed once @param wake_fd becomes readable, so their fiber_poll calls
+ * can observe it; wake_fd itself is never registered per fiber.
+ * @return 0 on success, -1 on failure
+ */
+int fiber_runtime_start(int nsched, int wake_fd, bool pin);
+
+/**
+ * Run @param fn(@param arg) on a new fiber.
+ * @return 0 on success, -1 on failure, in which case fn never runs
+ */
+int fiber_spawn(void (*fn)(void *), void *arg);
+
+/**
+ * poll() that parks the calling fiber instead of blocking its scheduler.  Outside a fiber,
+ * or with a zero @param timeout, this is plain poll().  On a fiber only timeouts of 0 and -1
+ * are supported.  Fails with ECANCELED once fiber_runtime_stop has given up waiting.
+ */
+int fiber_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+/**
+ * Wait up to @param drain_ms for every fiber to finish, then cancel the remaining fibers'
+ * waits and join the schedulers.  No fibers may be spawned once this is called.
+ */
+void fiber_runtime_stop(long drain_ms);
+
+#endif /* AESDSOCKET_FIBER_H */
@@ -0,0 +1,277 @@
+/**
+ * @file handover.c
+ * @brief Passing listeners and the datastore between aesdsocket processes
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "aesdsocket.h"
+#include "handover.h"
+
+#define HANDOVER_ACK_MS 5000  // How long the sender waits for the receiver's ack
+#define HANDOVER_MAX_FDS (DATASTORE_NFDS + HANDOVER_MAX_LISTENERS)
+
+struct handover_header {
+    char magic[4];
+    uint32_t nlisteners;
+    uint8_t binary[HANDOVER_MAX_LISTENERS];
+} __attribute__((packed));
+
+static const char *handover_path;
+static const struct handover_state *handover_state;
+static int listen_fd = -1;
+static pthread_t handover_thread;
+static bool handover_started;
+static volatile bool handed_over;
+
+/**
+ * Refuse peers running as another user: whoever is on the other end of @param fd either hands
+ * us the listeners and the datastore or receives ours.
+ * @return 0 if the peer runs with our effective uid, -1 with errno set otherwise
+ */
+static int check_peer(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return -1;
+    if (cred.uid != geteuid()) {
+        syslog(LOG_ERR, "Refusing a handover peer with uid %d", (int)cred.uid);
+        errno = EPERM;
+        return -1;
+    }
+    return 0;
+}
+
+static int unix_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handover_receive_fd(int fd, struct handover_state *state) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct handover_header header;
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    int fds[HANDOVER_MAX_FDS];
+    int nfds = 0, i, j;
+    bool excess = false;
+    ssize_t n;
+
+    if (check_peer(fd) < 0) return -1;
+    do {
+        n = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    // Collect the descriptors of every SCM_RIGHTS message, so none of them leaks
+    for (cmsg = CMSG_FIRSTHDR(&msg); n >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            for (j = 0; j < count; j++) {
+                int received;
+
+                memcpy(&received, CMSG_DATA(cmsg) + j * sizeof(int), sizeof(int));
+                if (nfds < HANDOVER_MAX_FDS) {
+                    fds[nfds++] = received;
+                } else {
+                    close(received);
+                    excess = true;
+                }
+            }
+        }
+    }
+    // A truncated transfer lost descriptors on the way, so it can't be complete
+    if (n != sizeof(header) || (msg.msg_flags & MSG_CTRUNC) || excess ||
+        memcmp(header.magic, HANDOVER_MAGIC, sizeof(header.magic)) != 0 ||
+        ntohl(header.nlisteners) > HANDOVER_MAX_LISTENERS ||
+        (size_t)nfds != DATASTORE_NFDS + ntohl(header.nlisteners) ||
+        write(fd, "A", 1) != 1) {
+        for (i = 0; i < nfds; i++) close(fds[i]);
+        errno = EPROTO;
+        return -1;
+    }
+
+    memcpy(state->datastore_fds, fds, sizeof(state->datastore_fds));
+    state->nlisteners = ntohl(header.nlisteners);
+    for (i = 0; i < state->nlisteners; i++) {
+        state->listeners[i] = fds[DATASTORE_NFDS + i];
+        state->binary[i] = header.binary[i];
+    }
+    return 0;
+}
+
+int handover_receive(const char *path, struct handover_state *state) {
+    struct sockaddr_un addr;
+    int fd, rc;
+
+    if (unix_address(path, &addr) < 0) return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int saved = errno;
+
+        close(fd);
+        errno = saved;
+        // Nobody there, or a socket file left behind by a process that is gone
+        return errno == ENOENT || errno == ECONNREFUSED ? 0 : -1;
+    }
+    rc = handover_receive_fd(fd, state);
+    close(fd);
+    return rc < 0 ? -1 : 1;
+}
+
+int handover_send(int fd, const struct handover_state *state) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct handover_header header = { .magic = HANDOVER_MAGIC };
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf };
+    int nfds = DATASTORE_NFDS + state->nlisteners;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct cmsghdr *cmsg;
+    char ack;
+    int i;
+
+    if (check_peer(fd) < 0) return -1;
+    header.nlisteners = htonl(state->nlisteners);
+    for (i = 0; i < state->nlisteners; i++) {
+        header.binary[i] = state->binary[i];
+    }
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), state->datastore_fds, sizeof(int) * DATASTORE_NFDS);
+    memcpy((int *)CMSG_DATA(cmsg) + DATASTORE_NFDS, state->listeners,
+           sizeof(int) * state->nlisteners);
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(header)) return -1;
+    if (poll(&pfd, 1, HANDOVER_ACK_MS) != 1 || read(fd, &ack, 1) != 1 || ack != 'A') return -1;
+    return 0;
+}
+
+static void *handover_thread_fn(void *args) {
+    (void)args;
+    while (!terminate_flag) {
+        struct pollfd pfds[2] = {
+            { .fd = listen_fd, .events = POLLIN },
+            { .fd = shutdown_efd, .events = POLLIN },
+        };
+        int fd;
+
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfds[1].revents) break;
+        fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        if (handover_send(fd, handover_state) < 0) {
+            syslog(LOG_ERR, "Hot restart handover failed, carrying on");
+            close(fd);
+            continue;
+        }
+        close(fd);
+        syslog(LOG_INFO, "Handed over to a new aesdsocket, draining");
+        handed_over = true;
+        // The successor owns the path now; shut down the usual way
+        kill(getpid(), SIGTERM);
+        break;
+    }
+    return NULL;
+}
+
+int handover_start(const char *path, const struct handover_state *state) {
+    struct sockaddr_un addr;
+
+    if (unix_address(path, &addr) < 0) return -1;
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) return -1;
+    // Replace the predecessor's socket file, or a stale one
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0) {
+        int saved = errno;
+
+        close(listen_fd);
+        listen_fd = -1;
+        errno = saved;
+        return -1;
+    }
+    handover_path = path;
+    handover_state = state;
+    if (pthread_create(&handover_thread, NULL, handover_thread_fn, NULL) != 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    handover_started = true;
+    return 0;
+}
+
+bool handover_stop(void) {
+    if (!handover_started) return false;
+    pthread_join(handover_thread, NULL);
+    handover_started = false;
+    close(listen_fd);
+    listen_fd = -1;
+    if (!handed_over) unlink(handover_path);
+    return handed_over;
+}
+
+int activation_listeners(int *listeners, bool *binary) {
+    const char *pid = getenv("LISTEN_PID");
+    const char *count = getenv("LISTEN_FDS");
+    const char *names = getenv("LISTEN_FDNAMES");
+    int n, i;
+
+    if (!pid || !count || strtol(pid, NULL, 10) != getpid()) return 0;
+    n = atoi(count);
+    if (n > HANDOVER_MAX_LISTENERS) n = HANDOVER_MAX_LISTENERS;
+    for (i = 0; i < n; i++) {
+        const char *end = names ? strchrnul(names, ':') : NULL;
+        int fd = 3 + i;
+
+        // Accept threads expect non-blocking listeners, and children must not inherit them
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        listeners[i] = fd;
+        binary[i] = names && end - names == 6 && memcmp(names, "binary", 6) == 0;
+        if (names) names = *end ? end + 1 : NULL;
+    }
+    // Not for our own children
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return n < 0 ? 0 : n;
+}
@@ -0,0 +1,81 @@
+/**
+ * @file handover.h
+ * @brief Taking over listeners and the datastore from a running aesdsocket, or from a
+ * service manager
+ *
+ * Hot restart: an aesdsocket started with -H path listens on that UNIX socket.  A new
+ * aesdsocket started with the same -H path connects to it first and receives, with
+ * SCM_RIGHTS, the old process's listening sockets and its shared datastore descriptors
+ * (datastore_export).  The new process acknowledges, starts accepting on the same sockets and
+ * takes over the path; the old process stops accepting, drains its connections and exits
+ * without removing the data file.  The listening sockets stay open throughout, so no
+ * connection is refused.  Both ends refuse a peer running as another user (SO_PEERCRED), and a
+ * transfer that arrives with fewer or more descriptors than announced is rejected.
+ *
+ * Pre-forked workers receive the same state from their supervisor over a socketpair
+ * (handover_send and handover_receive_fd).
+ *
+ * Socket activation: listening sockets passed by a service manager the systemd way
+ * (LISTEN_PID, LISTEN_FDS and optionally LISTEN_FDNAMES, descriptors from 3) are used
+ * instead of binding.  A socket named "binary" serves the binary protocol.
+ */
+
+#ifndef AESDSOCKET_HANDOVER_H
+#define AESDSOCKET_HANDOVER_H
+
+#include <stdbool.h>
+
+#include "datastore.h"
+
+#define HANDOVER_MAGIC "AEH1"
+#define HANDOVER_MAX_LISTENERS 65   // MAX_ACCEPTORS plus the binary port
+
+struct handover_state {
+    int datastore_fds[DATASTORE_NFDS];
+    int nlisteners;
+    int listeners[HANDOVER_MAX_LISTENERS];
+    bool binary[HANDOVER_MAX_LISTENERS];  // Listener serves the binary protocol
+};
+
+/**
+ * Take over from the aesdsocket listening on @param path, if any.
+ * @return 1 with @param state filled in, 0 if no process listens on @param path, -1 on error
+ */
+int handover_receive(const char *path, struct handover_state *state);
+
+/**
+ * Receive listeners and datastore descriptors sent with handover_send on the connected
+ * @param fd into @param state, and acknowledge them.
+ * @return 0 on success, -1 on error
+ */
+int handover_receive_fd(int fd, struct handover_state *state);
+
+/**
+ * Send @param state on the connected @param fd and wait for the receiver's acknowledgement.
+ * @return 0 once the receiver has everything, -1 otherwise
+ */
+int handover_send(int fd, const struct handover_state *state);
+
+/**
+ * Listen on @param path and hand @param state to the first successor that connects, then
+ * raise SIGTERM so this process drains and exits.  @param state must stay valid until
+ * handover_stop.
+ * @return 0 on success, -1 on failure
+ */
+int handover_start(const char *path, const struct handover_state *state);
+
+/**
+ * Stop listening for successors.  Call after shutdown_efd has been signalled.
+ * @return true if this process was handed over, in which case the successor owns the path
+ * and the data file
+ */
+bool handover_stop(void);
+
+/**
+ * Collect listening sockets passed by a service manager into @param listeners and
+ * @param binary, at most HANDOVER_MAX_LISTENERS.
+ * @return the number of sockets, 0 if none were passed
+ */
+int activation_listeners(int *listeners, bool *binary);
+
+#endif /* AESDSOCKET_HANDOVER_H */
@@ -0,0 +1,402 @@
+/**
+ * @file replication.c
+ * @brief Primary and follower sides of aesdsocket log replication
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "aesdsocket.h"
+#include "datastore.h"
+#include "replication.h"
+
+#define REPL_CHUNK (64 * 1024)
+#define REPL_MAX_FOLLOWERS 16
+#define REPL_WAIT_MS 100      // Longest a caught up sender goes without checking for acks
+#define REPL_RETRY_MS 1000    // Between a follower's connection attempts
+
+struct sender {
+    pthread_t thread;
+    int fd;
+    bool started;
+    int done;             // Set by the thread as it exits, so the slot can be reused
+};
+
+static const char *primary_addr;
+static int listen_fd = -1;
+static pthread_t listener_thread;
+static bool listener_started;
+static struct sender senders[REPL_MAX_FOLLOWERS];
+
+static const char *follow_addr;
+static pthread_t follower_thread;
+static bool follower_started;
+
+/**
+ * Create a socket for @param spec: bound and listening with @param listening, connected
+ * otherwise.
+ * @return the socket, or -1 on failure
+ */
+static int open_socket(const char *spec, bool listening) {
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res, *ai;
+    char host[256] = "";
+    const char *port = spec;
+    const char *colon = strrchr(spec, ':');
+    int one = 1;
+    int fd = -1;
+
+    if (spec[0] == '/') {
+        struct sockaddr_un un = { .sun_family = AF_UNIX };
+
+        if (strlen(spec) >= sizeof(un.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(un.sun_path, spec);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (listening) unlink(spec);
+        if (listening ? bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0 || listen(fd, 8) < 0
+                      : connect(fd, (struct sockaddr *)&un, sizeof(un)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    if (colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        port = colon + 1;
+    }
+    if (listening) hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host[0] ? host : listening ? NULL : "localhost", port, &hints, &res) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 8) == 0) break;
+        } else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/**
+ * Wait for @param events on @param fd, or for shutdown.
+ * @return 0 when ready, -1 on shutdown or error
+ */
+static int wait_fd(int fd, short events, int timeout_ms) {
+    struct pollfd pfds[2] = {
+        { .fd = fd, .events = events },
+        { .fd = shutdown_efd, .events = POLLIN },
+    };
+
+    while (poll(pfds, 2, timeout_ms) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return terminate_flag || pfds[1].revents ? -1 : 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN || wait_fd(fd, POLLOUT, -1) < 0) return -1;
+            continue;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, MSG_DONTWAIT);
+
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN || wait_fd(fd, POLLIN, -1) < 0) return -1;
+            continue;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Consume the acknowledgements a follower has sent so far, keeping the latest in
+ * @param acked.
+ * @return 0 on success, -1 once the follower has gone
+ */
+static int read_acks(int fd, char *partial, size_t *partial_len, uint64_t *acked) {
+    for (;;) {
+        ssize_t n = recv(fd, partial + *partial_len, sizeof(uint64_t) - *partial_len, MSG_DONTWAIT);
+
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        *partial_len += n;
+        if (*partial_len == sizeof(uint64_t)) {
+            uint64_t value;
+
+            memcpy(&value, partial, sizeof(value));
+            *acked = be64toh(value);
+            *partial_len = 0;
+        }
+    }
+}
+
+/**
+ * Stream the history to one follower, from the offset in its hello to the current end and
+ * then each append as it is committed.
+ */
+static void *sender_thread(void *args) {
+    struct sender *sender = args;
+    struct repl_hello hello;
+    char *buf = NULL;
+    char partial[sizeof(uint64_t)];
+    size_t partial_len = 0;
+    uint64_t offset, acked = 0;
+
+    if (recv_all(sender->fd, &hello, sizeof(hello)) < 0 ||
+        memcmp(hello.magic, REPL_MAGIC, REPL_MAGIC_LEN) != 0) {
+        syslog(LOG_WARNING, "Dropping follower without a valid hello");
+        goto out;
+    }
+    offset = acked = be64toh(hello.offset);
+    if (offset > (uint64_t)datastore_size()) {
+        syslog(LOG_ERR, "Follower is ahead of this primary at offset %llu",
+               (unsigned long long)offset);
+        goto out;
+    }
+    buf = malloc(sizeof(struct repl_record) + REPL_CHUNK);
+    if (!buf) goto out;
+    syslog(LOG_INFO, "Follower resuming at offset %llu", (unsigned long long)offset);
+
+    while (!terminate_flag) {
+        off_t end = datastore_wait(offset, REPL_WAIT_MS);
+
+        if (read_acks(sender->fd, partial, &partial_len, &acked) < 0) break;
+        while ((off_t)offset < end && !terminate_flag) {
+            struct repl_record record;
+            size_t want = end - offset < REPL_CHUNK ? end - offset : REPL_CHUNK;
+            ssize_t n = datastore_pread(buf + sizeof(record), want, offset);
+
+            if (n <= 0) {
+                syslog(LOG_ERR, "Can't read offset %llu for a follower: %s",
+                       (unsigned long long)offset, n < 0 ? strerror(errno) : "end of data");
+                goto out;
+            }
+            record.offset = htobe64(offset);
+            record.length = htobe32(n);
+            memcpy(buf, &record, sizeof(record));
+            if (send_all(sender->fd, buf, sizeof(record) + n) < 0) goto out;
+            offset += n;
+        }
+    }
+out:
+    syslog(LOG_INFO, "Follower disconnected, acknowledged up to offset %llu",
+           (unsigned long long)acked);
+    free(buf);
+    close(sender->fd);
+    __atomic_store_n(&sender->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *listener_thread_fn(void *args) {
+    (void)args;
+    while (wait_fd(listen_fd, POLLIN, -1) == 0) {
+        struct sender *sender = NULL;
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        int i;
+
+        if (fd < 0) continue;
+        for (i = 0; i < REPL_MAX_FOLLOWERS; i++) {
+            if (senders[i].started && __atomic_load_n(&senders[i].done, __ATOMIC_ACQUIRE)) {
+                pthread_join(senders[i].thread, NULL);
+                senders[i].started = false;
+            }
+            if (!senders[i].started && !sender) sender = &senders[i];
+        }
+        if (!sender) {
+            syslog(LOG_WARNING, "Too many followers, refusing one");
+            close(fd);
+            continue;
+        }
+        sender->fd = fd;
+        sender->done = 0;
+        if (pthread_create(&sender->thread, NULL, sender_thread, sender) != 0) {
+            perror("Replication thread creation failed");
+            close(fd);
+            continue;
+        }
+        sender->started = true;
+    }
+    return NULL;
+}
+
+int replication_start_primary(const char *addr) {
+    listen_fd = open_socket(addr, true);
+    if (listen_fd < 0) {
+        perror("replication listener failed");
+        return -1;
+    }
+    if (pthread_create(&listener_thread, NULL, listener_thread_fn, NULL) != 0) {
+        perror("Replication thread creation failed");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    primary_addr = addr;
+    listener_started = true;
+    return 0;
+}
+
+/**
+ * Apply the records arriving on @param fd until the connection fails or the server stops.
+ * Everything one recv returns is appended with a single write and then acknowledged.
+ */
+static void follow(int fd) {
+    struct repl_hello hello = { .magic = REPL_MAGIC };
+    struct repl_record record;
+    size_t header_len = 0;
+    uint32_t remaining = 0;   // Data bytes of the current record still to come
+    char *in = malloc(REPL_CHUNK);
+    char *batch = malloc(REPL_CHUNK);
+
+    hello.offset = htobe64(datastore_size());
+    if (!in || !batch || send_all(fd, &hello, sizeof(hello)) < 0) goto out;
+    syslog(LOG_INFO, "Following %s from offset %lld", follow_addr, (long long)datastore_size());
+
+    while (wait_fd(fd, POLLIN, -1) == 0) {
+        ssize_t n = recv(fd, in, REPL_CHUNK, MSG_DONTWAIT);
+        size_t pos = 0, batch_len = 0;
+
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (n <= 0) break;
+
+        while (pos < (size_t)n) {
+            size_t take;
+
+            if (remaining == 0) {
+                take = sizeof(record) - header_len;
+                if (take > n - pos) take = n - pos;
+                memcpy((char *)&record + header_len, in + pos, take);
+                header_len += take;
+                pos += take;
+                if (header_len < sizeof(record)) break;
+                header_len = 0;
+                remaining = be32toh(record.length);
+                if (be64toh(record.offset) != (uint64_t)datastore_size() + batch_len) {
+                    syslog(LOG_ERR, "Replication record at %llu does not follow offset %llu",
+                           (unsigned long long)be64toh(record.offset),
+                           (unsigned long long)datastore_size() + batch_len);
+                    goto out;
+                }
+                continue;
+            }
+            take = remaining < n - pos ? remaining : n - pos;
+            memcpy(batch + batch_len, in + pos, take);
+            batch_len += take;
+            pos += take;
+            remaining -= take;
+        }
+
+        if (batch_len > 0) {
+            uint64_t ack;
+            int rc;
+
+            datastore_lock();
+            rc = datastore_append(batch, batch_len);
+            datastore_unlock();
+            if (rc < 0) {
+                perror("applying replicated data failed");
+                break;
+            }
+            ack = htobe64(datastore_size());
+            if (send_all(fd, &ack, sizeof(ack)) < 0) break;
+        }
+    }
+out:
+    free(in);
+    free(batch);
+}
+
+static void *follower_thread_fn(void *args) {
+    (void)args;
+    while (!terminate_flag) {
+        int fd = open_socket(follow_addr, false);
+
+        if (fd >= 0) {
+            follow(fd);
+            close(fd);
+        }
+        if (!terminate_flag) {
+            syslog(LOG_WARNING, "Lost primary %s, reconnecting", follow_addr);
+        }
+        // Sleep until the retry is due, or return right away at shutdown
+        if (wait_fd(-1, 0, REPL_RETRY_MS) < 0) break;
+    }
+    return NULL;
+}
+
+int replication_start_follower(const char *addr) {
+    follow_addr = addr;
+    if (pthread_create(&follower_thread, NULL, follower_thread_fn, NULL) != 0) {
+        perror("Replication thread creation failed");
+        return -1;
+    }
+    follower_started = true;
+    return 0;
+}
+
+void replication_stop(void) {
+    int i;
+
+    if (follower_started) {
+        pthread_join(follower_thread, NULL);
+        follower_started = false;
+    }
+    if (!listener_started) return;
+    pthread_join(listener_thread, NULL);
+    listener_started = false;
+    for (i = 0; i < REPL_MAX_FOLLOWERS; i++) {
+        if (senders[i].started) pthread_join(senders[i].thread, NULL);
+        senders[i].started = false;
+    }
+    close(listen_fd);
+    listen_fd = -1;
+    if (primary_addr[0] == '/') unlink(primary_addr);
+}
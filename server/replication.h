@@ -0,0 +1,54 @@
+/**
+ * @file replication.h
+ * @brief Streaming the history from a primary aesdsocket to read only followers
+ *
+ * A follower connects to the primary's replication address and sends a struct repl_hello
+ * carrying the offset it already holds, which is also the last offset it acknowledged.  The
+ * primary then streams every committed byte from that offset on as struct repl_record
+ * headers followed by data, in order and without gaps.  The follower appends each batch it
+ * receives with one write and acknowledges the new end with a big endian u64.  After a
+ * disconnect the follower reconnects and resumes from its own end.  Both sides keep their data
+ * file on exit, so offsets stay valid across restarts of either one; a primary that started
+ * over from an empty file would find every follower ahead of it.
+ *
+ * Addresses are "/path" for a UNIX socket, or "[host:]port" for TCP; a primary without a host
+ * listens on every address, a follower without one connects to localhost.
+ * Multi byte integers are big endian.  File mode only.
+ */
+
+#ifndef AESDSOCKET_REPLICATION_H
+#define AESDSOCKET_REPLICATION_H
+
+#include <stdint.h>
+
+#define REPL_MAGIC "AER1"
+#define REPL_MAGIC_LEN 4
+
+struct repl_hello {
+    char magic[REPL_MAGIC_LEN];
+    uint64_t offset;      // First offset the follower needs
+} __attribute__((packed));
+
+struct repl_record {
+    uint64_t offset;      // Offset of the first data byte in the primary's history
+    uint32_t length;      // Data bytes following the header
+} __attribute__((packed));
+
+/**
+ * Listen for followers on @param addr, streaming to each from its own thread.
+ * @return 0 on success, -1 on failure
+ */
+int replication_start_primary(const char *addr);
+
+/**
+ * Follow the primary at @param addr from a background thread, reconnecting as needed.
+ * @return 0 on success, -1 on failure
+ */
+int replication_start_follower(const char *addr);
+
+/**
+ * Join every replication thread.  Call after shutdown_efd has been signalled.
+ */
+void replication_stop(void);
+
+#endif /* AESDSOCKET_REPLICATION_H */
@@ -0,0 +1,247 @@
+/**
+ * @file snapshot.c
+ * @brief Persistent snapshots of the aesdsocket history for fast warm restarts
+ *
+ * The on-disk layout is the one defined in aesdchar.h: a header, a table of entry sizes and
+ * the concatenated payload.  In file mode the payload is byte for byte the data file, so a
+ * restore is one mmap and one write.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include "aesdsocket.h"
+#include "snapshot.h"
+#include "../aesd-char-driver/aesdchar.h"
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int snapshot_validate(const void *snapshot, size_t len)
+{
+    const struct aesd_snapshot_header *hdr = snapshot;
+    const __u32 *sizes;
+    __u64 total = 0;
+    size_t table_bytes;
+
+    if (len < sizeof(*hdr) || hdr->magic != AESD_SNAPSHOT_MAGIC ||
+        hdr->version != AESD_SNAPSHOT_VERSION) {
+        return -1;
+    }
+    table_bytes = (size_t)hdr->entry_count * sizeof(__u32);
+    if (len - sizeof(*hdr) < table_bytes || len - sizeof(*hdr) - table_bytes != hdr->payload_bytes) {
+        return -1;
+    }
+    sizes = (const __u32 *)(hdr + 1);
+    for (__u32 i = 0; i < hdr->entry_count; i++) {
+        if (sizes[i] == 0) return -1;
+        total += sizes[i];
+    }
+    return total == hdr->payload_bytes ? 0 : -1;
+}
+
+/**
+ * Write a snapshot made of @param hdr, the @param sizes table and @param payload to @param path,
+ * atomically via a temporary file.
+ */
+static int write_snapshot_file(const char *path, const struct aesd_snapshot_header *hdr,
+                               const __u32 *sizes, const void *payload)
+{
+    char tmp_path[4096];
+    int fd;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    if (write_all(fd, hdr, sizeof(*hdr)) < 0 ||
+        write_all(fd, sizes, (size_t)hdr->entry_count * sizeof(__u32)) < 0 ||
+        write_all(fd, payload, hdr->payload_bytes) < 0 ||
+        fsync(fd) < 0) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    close(fd);
+    return rename(tmp_path, path);
+}
+
+#if USE_AESD_CHAR_DEVICE
+
+int snapshot_restore(const char *snapshot_path, const char *data_path)
+{
+    struct aesd_snapshot_buf req;
+    struct stat st;
+    void *map;
+    int fd, dev_fd, rc = -1;
+
+    fd = open(snapshot_path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    if (snapshot_validate(map, st.st_size) < 0) {
+        errno = EINVAL;
+    } else if ((dev_fd = open(data_path, O_RDWR)) >= 0) {
+        req.data = (__u64)(uintptr_t)map;
+        req.size = st.st_size;
+        rc = ioctl(dev_fd, AESDCHAR_IOCSNAPSHOT_LOAD, &req);
+        close(dev_fd);
+    }
+    munmap(map, st.st_size);
+    return rc < 0 ? -1 : 0;
+}
+
+int snapshot_save(const char *snapshot_path, const char *data_path)
+{
+    struct aesd_snapshot_buf req = { 0, 0 };
+    const struct aesd_snapshot_header *hdr;
+    char *buf = NULL;
+    int fd, rc;
+
+    fd = open(data_path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    // The first call reports the size needed; retry if history grew in between
+    while ((rc = ioctl(fd, AESDCHAR_IOCSNAPSHOT_SAVE, &req)) < 0 && errno == ENOSPC) {
+        char *grown = realloc(buf, req.size);
+        if (!grown) {
+            rc = -1;
+            break;
+        }
+        buf = grown;
+        req.data = (__u64)(uintptr_t)buf;
+    }
+    close(fd);
+    if (rc < 0 || !buf) {
+        free(buf);
+        return -1;
+    }
+
+    hdr = (const struct aesd_snapshot_header *)buf;
+    rc = write_snapshot_file(snapshot_path, hdr, (const __u32 *)(hdr + 1),
+                             buf + sizeof(*hdr) + (size_t)hdr->entry_count * sizeof(__u32));
+    free(buf);
+    return rc;
+}
+
+#else
+
+int snapshot_restore(const char *snapshot_path, const char *data_path)
+{
+    const struct aesd_snapshot_header *hdr;
+    struct stat st;
+    void *map;
+    int fd, data_fd, rc = -1;
+
+    fd = open(snapshot_path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    hdr = map;
+    if (snapshot_validate(map, st.st_size) < 0) {
+        errno = EINVAL;
+    } else if ((data_fd = open(data_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+        // In file mode the payload is exactly the data file contents
+        rc = write_all(data_fd, (const char *)map + st.st_size - hdr->payload_bytes, hdr->payload_bytes);
+        close(data_fd);
+    }
+    munmap(map, st.st_size);
+    return rc;
+}
+
+int snapshot_save(const char *snapshot_path, const char *data_path)
+{
+    struct aesd_snapshot_header hdr;
+    __u32 *sizes = NULL;
+    size_t capacity = 0;
+    const char *data = NULL;
+    struct stat st;
+    int fd, rc;
+
+    fd = open(data_path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = AESD_SNAPSHOT_MAGIC;
+    hdr.version = AESD_SNAPSHOT_VERSION;
+    hdr.payload_bytes = st.st_size;
+
+    // One entry per newline terminated command; a trailing partial line becomes the last entry
+    for (off_t pos = 0; pos < st.st_size;) {
+        const char *nl = memchr(data + pos, '\n', st.st_size - pos);
+        off_t end = nl ? nl - data + 1 : st.st_size;
+
+        if (hdr.entry_count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 64;
+            __u32 *grown = realloc(sizes, new_capacity * sizeof(*sizes));
+            if (!grown) {
+                free(sizes);
+                munmap((void *)data, st.st_size);
+                return -1;
+            }
+            sizes = grown;
+            capacity = new_capacity;
+        }
+        sizes[hdr.entry_count++] = end - pos;
+        pos = end;
+    }
+
+    rc = write_snapshot_file(snapshot_path, &hdr, sizes, data);
+    free(sizes);
+    if (data) munmap((void *)data, st.st_size);
+    return rc;
+}
+
+#endif
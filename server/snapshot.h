@@ -0,0 +1,31 @@
+/**
+ * @file snapshot.h
+ * @brief Save and restore aesdsocket history using the aesdchar snapshot format
+ */
+
+#ifndef AESDSOCKET_SNAPSHOT_H
+#define AESDSOCKET_SNAPSHOT_H
+
+#include <stddef.h>
+
+/**
+ * Restore the history stored in @param snapshot_path into @param data_path.
+ * In char device mode the mapped snapshot is handed to the driver with AESDCHAR_IOCSNAPSHOT_LOAD,
+ * otherwise the payload is written to the data file in a single pass.
+ * @return 0 on success, -1 with errno set on failure (ENOENT if there is no snapshot yet)
+ */
+int snapshot_restore(const char *snapshot_path, const char *data_path);
+
+/**
+ * Write the history held in @param data_path to @param snapshot_path.  The snapshot is written to
+ * a temporary file and renamed into place so a crash never leaves a torn snapshot behind.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int snapshot_save(const char *snapshot_path, const char *data_path);
+
+/**
+ * @return 0 if the @param len bytes at @param snapshot describe a well formed snapshot, -1 otherwise
+ */
+int snapshot_validate(const void *snapshot, size_t len);
+
+#endif /* AESDSOCKET_SNAPSHOT_H */
@@ -0,0 +1,411 @@
+/**
+ * @file tierstore.c
+ * @brief Hot ring and cold segment files behind the aesdsocket datastore
+ *
+ * Appends take tier_lock for writing; reads take it for reading, so a reader
+ * always sees the ring and the segment list in a consistent state.  Segment read descriptors
+ * are opened on first use and at most TIER_MAX_OPEN_SEGMENTS stay open; they are only opened
+ * or closed with tier_lock held for writing, so a reader's descriptor can't be closed under it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tierstore.h"
+
+#define TIER_MAX_OPEN_SEGMENTS 32
+#define SEGMENT_NAME_FORMAT "seg-%020llu.log"
+
+struct segment {
+    off_t start;              // Logical offset of the first byte
+    off_t len;
+    int fd;                   // Read descriptor, or -1 until first used
+    unsigned long last_use;   // For closing the least recently used descriptors
+};
+
+static pthread_rwlock_t tier_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct tier_config config;
+static char *ring;            // Copy of the newest segment bytes
+static size_t ring_head;      // Index of the oldest byte in ring
+static size_t ring_len;
+static off_t hot_start;       // Logical offset of the oldest byte in ring; ring ends at segments_end()
+static struct segment *segments;  // Oldest first, contiguous
+static size_t nsegments;
+static size_t segments_cap;
+static unsigned long long segment_total;  // Bytes in all segments
+static int active_fd = -1;    // Append descriptor of the newest segment until it is sealed
+static int open_fds;
+static unsigned long use_clock;
+
+static void segment_path(char *path, size_t size, off_t start) {
+    snprintf(path, size, "%s/" SEGMENT_NAME_FORMAT, config.dir, (unsigned long long)start);
+}
+
+static int add_segment(off_t start, off_t len) {
+    if (nsegments == segments_cap) {
+        size_t cap = segments_cap ? segments_cap * 2 : 16;
+        struct segment *grown = realloc(segments, cap * sizeof(*segments));
+
+        if (!grown) return -1;
+        segments = grown;
+        segments_cap = cap;
+    }
+    segments[nsegments].start = start;
+    segments[nsegments].len = len;
+    segments[nsegments].fd = -1;
+    segments[nsegments].last_use = 0;
+    nsegments++;
+    segment_total += len;
+    return 0;
+}
+
+static off_t segments_end(void) {
+    return nsegments ? segments[nsegments - 1].start + segments[nsegments - 1].len : 0;
+}
+
+/**
+ * Delete the oldest sealed segments while the segments exceed the retention limit.
+ */
+static void apply_retention(void) {
+    char path[PATH_MAX];
+
+    while (config.retain_bytes && segment_total > config.retain_bytes &&
+           nsegments > (active_fd >= 0 ? 2 : 1)) {
+        segment_path(path, sizeof(path), segments[0].start);
+        if (unlink(path) < 0) {
+            syslog(LOG_ERR, "Failed to remove segment %s: %s", path, strerror(errno));
+        }
+        if (segments[0].fd >= 0) {
+            close(segments[0].fd);
+            open_fds--;
+        }
+        segment_total -= segments[0].len;
+        memmove(segments, segments + 1, (nsegments - 1) * sizeof(*segments));
+        nsegments--;
+    }
+}
+
+/**
+ * Write @param len bytes to the end of the active segment, starting one if there is none, and
+ * seal the segment once it has reached the size cap.  Each append lands in a single segment,
+ * so a failed write can be undone by truncating that segment back to its previous length.
+ * Caller holds tier_lock for writing.
+ */
+static int segment_write(const char *buf, size_t len) {
+    struct segment *seg;
+    size_t written = 0;
+
+    if (active_fd < 0) {
+        char path[PATH_MAX];
+        off_t start = segments_end();
+
+        segment_path(path, sizeof(path), start);
+        active_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (active_fd < 0 || add_segment(start, 0) < 0) {
+            if (active_fd >= 0) close(active_fd);
+            active_fd = -1;
+            return -1;
+        }
+    }
+    seg = &segments[nsegments - 1];
+    while (written < len) {
+        ssize_t n = write(active_fd, buf + written, len - written);
+
+        if (n < 0) {
+            int saved = errno;
+
+            if (saved == EINTR) continue;
+            // Drop the partial append so the file keeps ending where the index says it does
+            if (written && ftruncate(active_fd, seg->len) < 0) {
+                syslog(LOG_ERR, "Failed to truncate segment at offset %lld: %s",
+                       (long long)seg->start, strerror(errno));
+                // Seal it; the next append starts a new segment at the indexed end
+                close(active_fd);
+                active_fd = -1;
+            }
+            errno = saved;
+            return -1;
+        }
+        written += n;
+    }
+    seg->len += len;
+    segment_total += len;
+    if ((size_t)seg->len >= config.segment_bytes) {
+        // Sealed: immutable from now on
+        close(active_fd);
+        active_fd = -1;
+        apply_retention();
+    }
+    return 0;
+}
+
+/**
+ * Copy @param len newly written bytes into the ring, dropping its oldest bytes to make room.
+ * Caller holds tier_lock for writing.
+ */
+static void ring_add(const char *buf, size_t len) {
+    size_t cap = config.hot_bytes;
+    size_t tail, first;
+
+    if (len >= cap) {
+        // Only the newest cap bytes fit
+        buf += len - cap;
+        len = cap;
+        ring_head = ring_len = 0;
+    } else if (ring_len + len > cap) {
+        size_t drop = ring_len + len - cap;
+
+        ring_head = (ring_head + drop) % cap;
+        ring_len -= drop;
+    }
+    tail = (ring_head + ring_len) % cap;
+    first = cap - tail < len ? cap - tail : len;
+    memcpy(ring + tail, buf, first);
+    memcpy(ring, buf + first, len - first);
+    ring_len += len;
+    hot_start = segments_end() - ring_len;
+}
+
+static int compare_segments(const void *a, const void *b) {
+    off_t sa = ((const struct segment *)a)->start;
+    off_t sb = ((const struct segment *)b)->start;
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+/**
+ * Rebuild the segment index from the file names in the store directory.
+ */
+static int load_segments(void) {
+    struct dirent *entry;
+    DIR *dir = opendir(config.dir);
+    size_t i, first = 0;
+
+    if (!dir) return -1;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        unsigned long long start;
+        struct stat st;
+        int consumed = 0;
+
+        if (sscanf(entry->d_name, "seg-%20llu.log%n", &start, &consumed) != 1 ||
+            consumed == 0 || entry->d_name[consumed] != '\0') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", config.dir, entry->d_name);
+        if (stat(path, &st) < 0 || add_segment(start, st.st_size) < 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    qsort(segments, nsegments, sizeof(*segments), compare_segments);
+
+    // Only a contiguous run ending at the newest segment is usable
+    for (i = 1; i < nsegments; i++) {
+        if (segments[i].start != segments[i - 1].start + segments[i - 1].len) {
+            syslog(LOG_WARNING, "Gap in segments before offset %lld; ignoring older segments",
+                   (long long)segments[i].start);
+            first = i;
+        }
+    }
+    for (i = 0; i < first; i++) {
+        segment_total -= segments[i].len;
+    }
+    memmove(segments, segments + first, (nsegments - first) * sizeof(*segments));
+    nsegments -= first;
+    return 0;
+}
+
+int tier_open(const struct tier_config *cfg) {
+    config = *cfg;
+    if (config.hot_bytes == 0 || config.segment_bytes == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mkdir(config.dir, 0755) < 0 && errno != EEXIST) return -1;
+    if (load_segments() < 0) return -1;
+
+    ring = malloc(config.hot_bytes);
+    if (!ring) return -1;
+    ring_head = ring_len = 0;
+    hot_start = segments_end();
+
+    // Keep appending to the newest segment if it was not sealed before the restart
+    if (nsegments && (size_t)segments[nsegments - 1].len < config.segment_bytes) {
+        char path[PATH_MAX];
+
+        segment_path(path, sizeof(path), segments[nsegments - 1].start);
+        active_fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (active_fd < 0) return -1;
+    }
+    return 0;
+}
+
+void tier_close(void) {
+    size_t i;
+
+    pthread_rwlock_wrlock(&tier_lock);
+    if (active_fd >= 0) close(active_fd);
+    active_fd = -1;
+    for (i = 0; i < nsegments; i++) {
+        if (segments[i].fd >= 0) close(segments[i].fd);
+    }
+    free(segments);
+    segments = NULL;
+    nsegments = segments_cap = 0;
+    segment_total = 0;
+    open_fds = 0;
+    free(ring);
+    ring = NULL;
+    pthread_rwlock_unlock(&tier_lock);
+}
+
+int tier_append(const char *buf, size_t len) {
+    int rc;
+
+    pthread_rwlock_wrlock(&tier_lock);
+    // Written through, so a crash loses nothing that was acknowledged
+    rc = segment_write(buf, len);
+    if (rc == 0) ring_add(buf, len);
+    pthread_rwlock_unlock(&tier_lock);
+    return rc;
+}
+
+/**
+ * @return the index of the segment holding logical @param offset, which must be below
+ * hot_start and at or above the first segment's start
+ */
+static size_t find_segment(off_t offset) {
+    size_t lo = 0, hi = nsegments;
+
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (segments[mid].start <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Open a read descriptor for the segment starting at @param start, closing the least
+ * recently used one if too many are open.  Takes tier_lock for writing.
+ */
+static int open_segment(off_t start) {
+    char path[PATH_MAX];
+    size_t i, idx, lru = 0;
+    int rc = 0;
+
+    pthread_rwlock_wrlock(&tier_lock);
+    if (nsegments == 0 || start < segments[0].start) goto out;  // Deleted meanwhile
+    idx = find_segment(start);
+    if (segments[idx].fd >= 0) goto out;
+
+    if (open_fds >= TIER_MAX_OPEN_SEGMENTS) {
+        for (i = 0; i < nsegments; i++) {
+            if (segments[i].fd >= 0 &&
+                (segments[lru].fd < 0 || segments[i].last_use < segments[lru].last_use)) {
+                lru = i;
+            }
+        }
+        close(segments[lru].fd);
+        segments[lru].fd = -1;
+        open_fds--;
+    }
+    segment_path(path, sizeof(path), segments[idx].start);
+    segments[idx].fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (segments[idx].fd < 0) {
+        rc = -1;
+    } else {
+        open_fds++;
+    }
+out:
+    pthread_rwlock_unlock(&tier_lock);
+    return rc;
+}
+
+ssize_t tier_pread(char *buf, size_t len, off_t offset) {
+    size_t total = 0;
+
+retry:
+    pthread_rwlock_rdlock(&tier_lock);
+    while (total < len) {
+        off_t pos = offset + total;
+        off_t end = hot_start + ring_len;
+        size_t want = len - total;
+        ssize_t n;
+
+        if (pos >= end) break;
+        if ((off_t)want > end - pos) want = end - pos;
+
+        if (pos >= hot_start) {
+            size_t idx = (ring_head + (pos - hot_start)) % config.hot_bytes;
+
+            if (want > config.hot_bytes - idx) want = config.hot_bytes - idx;
+            memcpy(buf + total, ring + idx, want);
+            n = want;
+        } else {
+            struct segment *seg;
+
+            if (nsegments == 0 || pos < segments[0].start) {
+                pthread_rwlock_unlock(&tier_lock);
+                if (total) return total;
+                errno = ENODATA;
+                return -1;
+            }
+            seg = &segments[find_segment(pos)];
+            if (seg->fd < 0) {
+                off_t start = seg->start;
+
+                pthread_rwlock_unlock(&tier_lock);
+                if (open_segment(start) < 0) return total ? (ssize_t)total : -1;
+                goto retry;
+            }
+            __atomic_store_n(&seg->last_use, __atomic_add_fetch(&use_clock, 1, __ATOMIC_RELAXED),
+                             __ATOMIC_RELAXED);
+            if ((off_t)want > seg->start + seg->len - pos) want = seg->start + seg->len - pos;
+            n = pread(seg->fd, buf + total, want, pos - seg->start);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) continue;
+                pthread_rwlock_unlock(&tier_lock);
+                return total ? (ssize_t)total : -1;
+            }
+        }
+        total += n;
+    }
+    pthread_rwlock_unlock(&tier_lock);
+    return total;
+}
+
+off_t tier_end(void) {
+    off_t end;
+
+    pthread_rwlock_rdlock(&tier_lock);
+    end = hot_start + ring_len;
+    pthread_rwlock_unlock(&tier_lock);
+    return end;
+}
+
+off_t tier_base(void) {
+    off_t base;
+
+    pthread_rwlock_rdlock(&tier_lock);
+    // The ring may still hold bytes whose segment retention has deleted
+    base = nsegments && segments[0].start < hot_start ? segments[0].start : hot_start;
+    pthread_rwlock_unlock(&tier_lock);
+    return base;
+}
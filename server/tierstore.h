@@ -0,0 +1,63 @@
+/**
+ * @file tierstore.h
+ * @brief Tiered history for aesdsocket: a hot ring in memory over cold segment files
+ *
+ * The history is one append-only byte stream addressed by logical offset.  Every append is
+ * written through to the active segment file in the store directory before it is
+ * acknowledged, so it survives a crash or SIGKILL of the process like the plain data file does;
+ * only a power failure or kernel crash can lose the writes still in the page cache.  A copy of
+ * the newest bytes is kept in a fixed size in-memory ring, which serves recent reads without
+ * touching the disk.  A segment that reaches the size cap is sealed and never written again.
+ * Segment files are named after the logical offset of their first byte, so the directory
+ * listing is the sparse index that maps an offset to a segment, rebuilt at startup.
+ *
+ * The retention policy deletes the oldest sealed segments once the segments hold more than
+ * retain_bytes.  Offsets below tier_base() are gone from then on.  Memory use is bounded by
+ * the ring plus one small index entry per segment.
+ */
+
+#ifndef AESDSOCKET_TIERSTORE_H
+#define AESDSOCKET_TIERSTORE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct tier_config {
+    const char *dir;          // Segment directory, created if missing
+    size_t hot_bytes;         // Capacity of the in-memory ring
+    size_t segment_bytes;     // Size at which a segment is sealed
+    unsigned long long retain_bytes;  // Segment bytes kept, 0 for unlimited
+};
+
+/**
+ * Open the store described by @param config, recovering the history already in its directory.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int tier_open(const struct tier_config *config);
+
+/**
+ * Close the segments and release everything.
+ */
+void tier_close(void);
+
+/**
+ * Append @param len bytes.  Callers serialize appends (the datastore lock).
+ * @return 0 on success, -1 with errno set on failure
+ */
+int tier_append(const char *buf, size_t len);
+
+/**
+ * Read up to @param len bytes at logical @param offset, across segments and the ring.
+ * Safe to call concurrently with appends.
+ * @return bytes read, 0 at the end of the history, -1 with errno ENODATA if retention has
+ * already deleted @param offset, or -1 with another errno on failure
+ */
+ssize_t tier_pread(char *buf, size_t len, off_t offset);
+
+// Logical offset just past the newest byte
+off_t tier_end(void);
+
+// Oldest logical offset still retained
+off_t tier_base(void);
+
+#endif /* AESDSOCKET_TIERSTORE_H */
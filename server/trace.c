@@ -0,0 +1,150 @@
+/**
+ * @file trace.c
+ * @brief Per-thread event rings dumped as Chrome trace JSON
+ *
+ * Every thread that records an event gets a fixed size ring.  Only the owning thread writes
+ * to it, publishing each slot by advancing head with a release store, so recording takes no
+ * lock.  The dump reads head with an acquire load and copies the newest TRACE_RING_EVENTS
+ * slots; a slot being overwritten during the copy can appear torn, which is acceptable for a
+ * diagnostic dump.  Rings of exited threads are kept, with their events, and handed to the
+ * next new thread, so per-connection threads don't grow the list without bound.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#ifdef AESD_TRACE_RING
+
+#define TRACE_RING_EVENTS 4096  // Per thread, power of two
+
+struct trace_event {
+    uint64_t ts_ns;
+    uint64_t arg;
+    const char *name;     // String literal, never freed
+    pid_t tid;
+    char phase;
+};
+
+struct trace_ring {
+    struct trace_ring *next;  // Registration list, only ever prepended to
+    int in_use;               // Owned by a live thread
+    uint64_t head;            // Number of events recorded
+    struct trace_event events[TRACE_RING_EVENTS];
+};
+
+static struct trace_ring *rings;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_ring *my_ring;
+static __thread pid_t my_tid;
+
+static void release_ring(void *ring) {
+    __atomic_store_n(&((struct trace_ring *)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/**
+ * Attach a ring to the calling thread, reusing one left by an exited thread if possible.
+ */
+static struct trace_ring *acquire_ring(void) {
+    struct trace_ring *ring;
+
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_mutex_lock(&rings_mutex);
+    for (ring = rings; ring; ring = ring->next) {
+        if (!__atomic_load_n(&ring->in_use, __ATOMIC_ACQUIRE)) break;
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (ring) {
+            ring->next = rings;
+            rings = ring;
+        }
+    }
+    if (ring) {
+        ring->in_use = 1;
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    if (ring) {
+        pthread_setspecific(ring_key, ring);
+    }
+    my_tid = syscall(SYS_gettid);
+    return ring;
+}
+
+void trace_ring_record(const char *name, char phase, uint64_t arg) {
+    struct trace_ring *ring = my_ring;
+    struct trace_event *event;
+    struct timespec now;
+    uint64_t head;
+
+    if (!ring) {
+        ring = my_ring = acquire_ring();
+        if (!ring) return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    head = ring->head;
+    event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+    event->ts_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    event->arg = arg;
+    event->name = name;
+    event->tid = my_tid;
+    event->phase = phase;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_dump(const char *path) {
+    struct trace_ring *ring;
+    struct trace_event event;
+    const char *sep = "";
+    pid_t pid = getpid();
+    FILE *out;
+
+    out = fopen(path, "w");
+    if (!out) return -1;
+
+    fputs("{\"traceEvents\":[\n", out);
+    pthread_mutex_lock(&rings_mutex);
+    for (ring = rings; ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t i = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+        for (; i < head; i++) {
+            event = ring->events[i & (TRACE_RING_EVENTS - 1)];
+            fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,"
+                    "\"tid\":%d,\"args\":{\"arg\":%llu}}",
+                    sep, event.name, event.phase,
+                    (unsigned long long)(event.ts_ns / 1000),
+                    (unsigned long long)(event.ts_ns % 1000),
+                    (int)pid, (int)event.tid, (unsigned long long)event.arg);
+            sep = ",\n";
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    fputs("\n]}\n", out);
+
+    if (fclose(out) != 0) return -1;
+    return 0;
+}
+
+#else
+
+int trace_dump(const char *path) {
+    (void)path;
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
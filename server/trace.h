@@ -0,0 +1,64 @@
+/**
+ * @file trace.h
+ * @brief Hot path tracing for aesdsocket
+ *
+ * Two independent mechanisms share the TRACE_BEGIN/TRACE_END markers:
+ *  - USDT probes (provider "aesdsocket", probes "<stage>_begin" and "<stage>_end") whenever
+ *    <sys/sdt.h> is available.  An unattached probe is a single nop; attach with e.g.
+ *    bpftrace -e 'usdt:./aesdsocket:aesdsocket:lock_wait_end { @[arg0] = count(); }'.
+ *    Define AESD_NO_USDT to leave them out.
+ *  - An in-process ring of recent events per thread, built only with -DAESD_TRACE_RING.
+ *    SIGUSR1 writes the rings to TRACE_DUMP_PATH as Chrome trace JSON (chrome://tracing,
+ *    Perfetto).
+ * With neither, the markers expand to nothing and their arguments are not evaluated.
+ */
+
+#ifndef AESDSOCKET_TRACE_H
+#define AESDSOCKET_TRACE_H
+
+#include <stdint.h>
+
+#if defined(__has_include) && !defined(AESD_NO_USDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AESD_HAVE_USDT 1
+#endif
+#endif
+
+#define TRACE_DUMP_PATH "/var/tmp/aesdsocket-trace.json"
+
+#ifdef AESD_TRACE_RING
+/**
+ * Record a Chrome trace event with phase @param phase ('B' or 'E') for @param name, which
+ * must be a string literal.  Lock free: each thread writes only its own ring.
+ */
+void trace_ring_record(const char *name, char phase, uint64_t arg);
+#define TRACE_RING(name, phase, arg) trace_ring_record(name, phase, (uint64_t)(arg))
+#else
+#define TRACE_RING(name, phase, arg) do { } while (0)
+#endif
+
+#ifdef AESD_HAVE_USDT
+#define TRACE_USDT(probe, arg) DTRACE_PROBE1(aesdsocket, probe, (uint64_t)(arg))
+#else
+#define TRACE_USDT(probe, arg) do { } while (0)
+#endif
+
+// Mark the start and end of @param stage; @param arg is attached to the event (bytes, etc.)
+#define TRACE_BEGIN(stage, arg) do { \
+        TRACE_USDT(stage##_begin, arg); \
+        TRACE_RING(#stage, 'B', arg); \
+    } while (0)
+#define TRACE_END(stage, arg) do { \
+        TRACE_USDT(stage##_end, arg); \
+        TRACE_RING(#stage, 'E', arg); \
+    } while (0)
+
+/**
+ * Write every thread's ring to @param path as Chrome trace JSON.  Called from the main
+ * thread when SIGUSR1 is received; a no-op without AESD_TRACE_RING.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int trace_dump(const char *path);
+
+#endif /* AESDSOCKET_TRACE_H */
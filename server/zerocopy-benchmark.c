@@ -0,0 +1,296 @@
+/**
+ * @file zerocopy-benchmark.c
+ * @brief Compare CPU per GB for aesdsocket's copy and MSG_ZEROCOPY reply paths
+ *
+ * Sends a file of -m MiB -n times over TCP with each path: pread into a 16 KiB buffer and
+ * send (the copy path), and send from a shared mapping with MSG_ZEROCOPY in 256 KiB chunks
+ * (the zero copy path).  The receiver is a local discard thread unless -H/-P name a remote
+ * sink, e.g. "nc -l 9000 > /dev/null".  Over loopback the kernel copies zero copy sends
+ * anyway, so use a remote sink to see the real difference.
+ *
+ * Reported CPU is the sending thread's own (CLOCK_THREAD_CPUTIME_ID); work the kernel does
+ * in softirq context on other CPUs is not included.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+#define COPY_CHUNK 16384
+#define ZEROCOPY_CHUNK (256 * 1024)
+
+struct result {
+    double cpu_s;
+    double wall_s;
+    unsigned long sends;
+    unsigned long copied;   // Zero copy sends the kernel reported copying
+};
+
+static double now(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *sink_thread(void *args) {
+    int listen_fd = *(int *)args;
+    char buf[1 << 16];
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+
+        if (fd < 0) return NULL;
+        while (read(fd, buf, sizeof(buf)) > 0)
+            ;
+        close(fd);
+    }
+}
+
+static int start_local_sink(int *port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t len = sizeof(addr);
+    static int listen_fd;
+    pthread_t thread;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 4) < 0 || getsockname(listen_fd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("sink setup failed");
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    if (pthread_create(&thread, NULL, sink_thread, &listen_fd) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+static int connect_sink(const char *host, int port) {
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    char service[16];
+    int fd;
+
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        fprintf(stderr, "cannot resolve %s\n", host);
+        return -1;
+    }
+    fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) perror("connect failed");
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len, int flags, struct result *res) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, flags);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        res->sends++;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int run_copy(int fd, int file_fd, size_t size, int repeats, struct result *res) {
+    char buf[COPY_CHUNK];
+    int r;
+
+    for (r = 0; r < repeats; r++) {
+        off_t offset = 0;
+
+        while ((size_t)offset < size) {
+            ssize_t n = pread(file_fd, buf, sizeof(buf), offset);
+
+            if (n <= 0 || send_all(fd, buf, n, MSG_NOSIGNAL, res) < 0) return -1;
+            offset += n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read zero copy completions; with @param wait block until one arrives.
+ * @return the highest completed send id plus one, or -1 on error
+ */
+static long reap(int fd, bool wait, struct result *res, uint32_t done) {
+    for (;;) {
+        char control[128];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        struct cmsghdr *cmsg;
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            struct pollfd pfd = { .fd = fd, .events = 0 };
+
+            if (errno != EAGAIN) return -1;
+            if (!wait) return done;
+            poll(&pfd, 1, -1);  // The error queue raises POLLERR
+            continue;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                res->copied += serr->ee_data - serr->ee_info + 1;
+            }
+            done = serr->ee_data + 1;
+        }
+        wait = false;
+    }
+}
+
+static int run_zerocopy(int fd, int file_fd, size_t size, int repeats, struct result *res) {
+    uint32_t sent = 0;
+    long done = 0;
+    int one = 1;
+    char *map;
+    int r;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        perror("SO_ZEROCOPY failed");
+        return -1;
+    }
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, file_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap failed");
+        return -1;
+    }
+    for (r = 0; r < repeats; r++) {
+        size_t offset = 0;
+
+        while (offset < size) {
+            size_t len = size - offset < ZEROCOPY_CHUNK ? size - offset : ZEROCOPY_CHUNK;
+            ssize_t n = send(fd, map + offset, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+
+            if (n < 0 && errno == ENOBUFS) {
+                // Too many pinned pages outstanding; wait for completions
+                done = reap(fd, true, res, done);
+                if (done < 0) break;
+                continue;
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            sent++;
+            res->sends++;
+            offset += n;
+            done = reap(fd, false, res, done);
+            if (done < 0) break;
+        }
+        if (offset < size) {
+            munmap(map, size);
+            return -1;
+        }
+    }
+    while (done >= 0 && (uint32_t)done != sent) {
+        done = reap(fd, true, res, done);
+    }
+    munmap(map, size);
+    return done < 0 ? -1 : 0;
+}
+
+static int measure(const char *name, const char *host, int port, int file_fd, size_t size,
+                   int repeats, bool zerocopy) {
+    struct result res = { 0 };
+    double cpu, wall, gb = (double)size * repeats / 1e9;
+    int fd = connect_sink(host, port);
+    int rc;
+
+    if (fd < 0) return -1;
+    cpu = now(CLOCK_THREAD_CPUTIME_ID);
+    wall = now(CLOCK_MONOTONIC);
+    rc = zerocopy ? run_zerocopy(fd, file_fd, size, repeats, &res)
+                  : run_copy(fd, file_fd, size, repeats, &res);
+    res.cpu_s = now(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    res.wall_s = now(CLOCK_MONOTONIC) - wall;
+    close(fd);
+    if (rc < 0) {
+        perror(name);
+        return -1;
+    }
+
+    printf("%-9s %8.1f ms CPU/GB %8.2f GB/s %8lu sends", name, res.cpu_s * 1e3 / gb,
+           gb / res.wall_s, res.sends);
+    if (zerocopy) printf(" (%lu copied by the kernel)", res.copied);
+    printf("\n");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    char path[] = "/var/tmp/zerocopy-benchmark.XXXXXX";
+    const char *host = "127.0.0.1";
+    size_t mib = 256, size, i;
+    int repeats = 8;
+    int port = 0;
+    int file_fd, c;
+    char *chunk;
+
+    while ((c = getopt(argc, argv, "m:n:H:P:")) != -1) {
+        switch (c) {
+        case 'm': mib = strtoul(optarg, NULL, 0); break;
+        case 'n': repeats = atoi(optarg); break;
+        case 'H': host = optarg; break;
+        case 'P': port = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-m MiB] [-n repeats] [-H sink_host -P sink_port]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (mib == 0 || repeats < 1) {
+        fprintf(stderr, "-m and -n must be positive\n");
+        return EXIT_FAILURE;
+    }
+    if (port == 0 && start_local_sink(&port) < 0) return EXIT_FAILURE;
+
+    size = mib << 20;
+    file_fd = mkstemp(path);
+    chunk = malloc(1 << 20);
+    if (file_fd < 0 || !chunk) {
+        perror("data file setup failed");
+        return EXIT_FAILURE;
+    }
+    unlink(path);
+    for (i = 0; i < (1 << 20); i++) chunk[i] = 'a' + i % 26;
+    for (i = 0; i < mib; i++) {
+        if (write(file_fd, chunk, 1 << 20) != 1 << 20) {
+            perror("write failed");
+            return EXIT_FAILURE;
+        }
+    }
+    free(chunk);
+
+    printf("%zu MiB x %d to %s:%d\n", mib, repeats, host, port);
+    if (measure("copy", host, port, file_fd, size, repeats, false) < 0 ||
+        measure("zerocopy", host, port, file_fd, size, repeats, true) < 0) {
+        return EXIT_FAILURE;
+    }
+    close(file_fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+/**
+ * @file Test_exec_batch.c
+ * @brief Unity tests for do_exec_batch
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "unity.h"
+#include "../../examples/systemcalls/systemcalls.h"
+
+#define SLEEP_MS 200
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Run a batch mixing commands that succeed, exit non-zero, cannot be started and cannot open
+ * their output file, with @param engine, and check each request's result.
+ */
+static void check_mixed_batch(enum exec_engine engine)
+{
+    char * const ok_argv[] = { "/bin/true", NULL };
+    char * const false_argv[] = { "/bin/false", NULL };
+    char * const exit3_argv[] = { "/bin/sh", "-c", "exit 3", NULL };
+    char * const relative_argv[] = { "true", NULL };
+    char * const echo_argv[] = { "/bin/echo", "lost", NULL };
+    struct exec_request requests[] = {
+        { .argv = ok_argv },
+        { .argv = false_argv },
+        { .argv = exit3_argv },
+        { .argv = relative_argv },
+        { .argv = echo_argv, .outputfile = "/aesd-no-such-dir/out.txt" },
+        { .argv = ok_argv },
+    };
+    size_t i;
+
+    set_exec_engine(engine);
+    TEST_ASSERT_FALSE(do_exec_batch(requests, 6, 2));
+
+    TEST_ASSERT_TRUE(requests[0].success);
+    TEST_ASSERT_EQUAL_INT(0, requests[0].exit_status);
+    TEST_ASSERT_FALSE(requests[1].success);
+    TEST_ASSERT_EQUAL_INT(1, requests[1].exit_status);
+    TEST_ASSERT_FALSE(requests[2].success);
+    TEST_ASSERT_EQUAL_INT(3, requests[2].exit_status);
+    // posix_spawn fails to start it; a forked child exits 1 after execv fails
+    TEST_ASSERT_FALSE(requests[3].success);
+    TEST_ASSERT_FALSE(requests[4].success);
+    TEST_ASSERT_EQUAL_INT(-1, requests[4].exit_status);
+    TEST_ASSERT_TRUE(requests[5].success);
+    TEST_ASSERT_EQUAL_INT(0, requests[5].exit_status);
+    for (i = 0; i < 6; i++) {
+        TEST_ASSERT_TRUE(requests[i].wall_time_ms >= 0);
+    }
+}
+
+void test_exec_batch_mixed_fork(void)
+{
+    check_mixed_batch(EXEC_ENGINE_FORK);
+    set_exec_engine(EXEC_ENGINE_SPAWN);
+}
+
+void test_exec_batch_mixed_spawn(void)
+{
+    check_mixed_batch(EXEC_ENGINE_SPAWN);
+}
+
+void test_exec_batch_all_succeed(void)
+{
+    char * const ok_argv[] = { "/bin/true", NULL };
+    struct exec_request requests[8];
+    size_t i;
+
+    memset(requests, 0, sizeof(requests));
+    for (i = 0; i < 8; i++) {
+        requests[i].argv = ok_argv;
+    }
+    TEST_ASSERT_TRUE(do_exec_batch(requests, 8, 3));
+    for (i = 0; i < 8; i++) {
+        TEST_ASSERT_TRUE(requests[i].success);
+    }
+    TEST_ASSERT_TRUE(do_exec_batch(requests, 0, 3));
+}
+
+/**
+ * Four 200 ms sleeps two at a time take two rounds: at least 400 ms, and well under the
+ * 800 ms they would take one at a time.
+ */
+void test_exec_batch_max_parallel_wall_time(void)
+{
+    char * const sleep_argv[] = { "/bin/sleep", "0.2", NULL };
+    struct exec_request requests[4];
+    double start, elapsed;
+    size_t i;
+
+    memset(requests, 0, sizeof(requests));
+    for (i = 0; i < 4; i++) {
+        requests[i].argv = sleep_argv;
+    }
+    start = now_ms();
+    TEST_ASSERT_TRUE(do_exec_batch(requests, 4, 2));
+    elapsed = now_ms() - start;
+
+    TEST_ASSERT_TRUE(elapsed >= 2 * SLEEP_MS);
+    TEST_ASSERT_TRUE(elapsed < 4 * SLEEP_MS - SLEEP_MS / 2);
+    for (i = 0; i < 4; i++) {
+        TEST_ASSERT_TRUE(requests[i].wall_time_ms >= SLEEP_MS);
+    }
+}
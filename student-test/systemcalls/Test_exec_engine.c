@@ -0,0 +1,77 @@
+/**
+ * @file Test_exec_engine.c
+ * @brief Unity tests for do_exec and do_exec_redirect with each exec engine
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unity.h"
+#include "../../examples/systemcalls/systemcalls.h"
+
+#define REDIRECT_FILE "/tmp/aesd-test-exec-engine.txt"
+
+/**
+ * Read the first line of @param path into @param buf, or return false if it cannot be read.
+ */
+static bool read_line(const char *path, char *buf, size_t size)
+{
+    FILE *f = fopen(path, "r");
+    bool ok;
+
+    if (!f) {
+        return false;
+    }
+    ok = fgets(buf, size, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+/**
+ * Run the success and failure cases of do_exec and do_exec_redirect with @param engine.
+ */
+static void check_engine(enum exec_engine engine)
+{
+    char line[64];
+
+    set_exec_engine(engine);
+    TEST_ASSERT_EQUAL_INT(engine, get_exec_engine());
+
+    TEST_ASSERT_TRUE(do_exec(1, "/bin/true"));
+    TEST_ASSERT_TRUE(do_exec(3, "/bin/sh", "-c", "exit 0"));
+    TEST_ASSERT_FALSE(do_exec(1, "/bin/false"));
+    TEST_ASSERT_FALSE(do_exec(3, "/bin/sh", "-c", "exit 3"));
+    TEST_ASSERT_FALSE(do_exec(1, "/bin/aesd-no-such-command"));
+    // Neither engine searches PATH, so a relative command must not run
+    TEST_ASSERT_FALSE(do_exec(2, "echo", "relative"));
+
+    remove(REDIRECT_FILE);
+    TEST_ASSERT_TRUE(do_exec_redirect(REDIRECT_FILE, 2, "/bin/echo", "redirected"));
+    TEST_ASSERT_TRUE(read_line(REDIRECT_FILE, line, sizeof(line)));
+    TEST_ASSERT_EQUAL_STRING("redirected\n", line);
+    // An existing file is truncated
+    TEST_ASSERT_TRUE(do_exec_redirect(REDIRECT_FILE, 2, "/bin/echo", "again"));
+    TEST_ASSERT_TRUE(read_line(REDIRECT_FILE, line, sizeof(line)));
+    TEST_ASSERT_EQUAL_STRING("again\n", line);
+    TEST_ASSERT_FALSE(do_exec_redirect(REDIRECT_FILE, 1, "/bin/false"));
+    remove(REDIRECT_FILE);
+
+    TEST_ASSERT_FALSE(do_exec_redirect("/aesd-no-such-dir/out.txt", 2, "/bin/echo", "lost"));
+}
+
+void test_exec_engine_default_is_spawn(void)
+{
+    TEST_ASSERT_EQUAL_INT(EXEC_ENGINE_SPAWN, get_exec_engine());
+}
+
+void test_exec_engine_fork(void)
+{
+    check_engine(EXEC_ENGINE_FORK);
+    set_exec_engine(EXEC_ENGINE_SPAWN);
+}
+
+void test_exec_engine_spawn(void)
+{
+    check_engine(EXEC_ENGINE_SPAWN);
+}